@@ -0,0 +1,251 @@
+// Compare two benchmark --format csv result files: a result is a
+// regression if its throughput dropped by more than the threshold and
+// Welch's t-test says the difference is significant. Results measured
+// once (reps < 2) can't be tested and are reported as n/a.
+//
+// usage: bench_compare [--threshold X] [--alpha P] base.csv new.csv
+//
+// Exit status: 0 - no regressions, 1 - regressions, 2 - bad input.
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+struct Row
+{
+    double mean, sd;
+    size_t n;
+};
+
+typedef std::tuple<std::string, std::string, size_t> Key;
+
+// Fields of a CSV record (RFC 4180); false if a quoted field continues
+// on the next line
+bool split(const std::string &line, std::vector<std::string> &fields)
+{
+    fields.clear();
+    std::string field;
+    bool quoted = false;
+    for (size_t k = 0; k < line.size(); k++) {
+        char c = line[k];
+        if (quoted) {
+            if (c != '"')
+                field += c;
+            else if (k + 1 < line.size() && line[k + 1] == '"')
+                field += line[++k];
+            else
+                quoted = false;
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(field);
+            field.clear();
+        } else {
+            field += c;
+        }
+    }
+    fields.push_back(field);
+    return !quoted;
+}
+
+// A CSV field, quoted if needed
+std::string csv_field(const std::string &s)
+{
+    if (s.find_first_of(",\"\r\n") == std::string::npos)
+        return s;
+    std::string res = "\"";
+    for (char c: s) {
+        if (c == '"')
+            res += '"';
+        res += c;
+    }
+    return res + "\"";
+}
+
+// contestant, sample, size -> GB/s; host info comments are echoed
+bool load(const char *path, std::map<Key, Row> &rows)
+{
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << path << ": can't open" << std::endl;
+        return false;
+    }
+    std::string line;
+    std::vector<std::string> header;
+    while (std::getline(in, line)) {
+        if (line.empty())
+            continue;
+        if (line[0] == '#') {
+            std::cout << "# " << path << ": " << line.substr(1) << std::endl;
+            continue;
+        }
+        std::vector<std::string> fields;
+        while (!split(line, fields)) {
+            std::string more;
+            if (!std::getline(in, more)) {
+                std::cerr << path << ": unterminated quoted field"
+                    << std::endl;
+                return false;
+            }
+            line += "\n" + more;
+        }
+        if (header.empty()) {
+            header = fields;
+            continue;
+        }
+        std::map<std::string, std::string> rec;
+        for (size_t k = 0; k < header.size() && k < fields.size(); k++)
+            rec[header[k]] = fields[k];
+        if (!rec.count("gbps_mean") || !rec.count("gbps_sd") ||
+            !rec.count("reps")) {
+            std::cerr << path << ": not a benchmark CSV" << std::endl;
+            return false;
+        }
+        Row row = {
+            atof(rec["gbps_mean"].c_str()),
+            atof(rec["gbps_sd"].c_str()),
+            (size_t)atol(rec["reps"].c_str()) };
+        rows[Key(rec["contestant"], rec["sample"],
+                 atol(rec["size"].c_str()))] = row;
+    }
+    return true;
+}
+
+// Regularized incomplete beta function I_x(a, b), continued fraction
+// (Numerical Recipes, betacf)
+double betacf(double a, double b, double x)
+{
+    const double eps = 1e-12, tiny = 1e-300;
+    double qab = a + b, qap = a + 1.0, qam = a - 1.0;
+    double c = 1.0, d = 1.0 - qab * x / qap;
+    if (std::fabs(d) < tiny)
+        d = tiny;
+    d = 1.0 / d;
+    double h = d;
+    for (int m = 1; m <= 300; m++) {
+        int m2 = 2 * m;
+        double aa = m * (b - m) * x / ((qam + m2) * (a + m2));
+        d = 1.0 + aa * d;
+        if (std::fabs(d) < tiny)
+            d = tiny;
+        c = 1.0 + aa / c;
+        if (std::fabs(c) < tiny)
+            c = tiny;
+        d = 1.0 / d;
+        h *= d * c;
+        aa = -(a + m) * (qab + m) * x / ((a + m2) * (qap + m2));
+        d = 1.0 + aa * d;
+        if (std::fabs(d) < tiny)
+            d = tiny;
+        c = 1.0 + aa / c;
+        if (std::fabs(c) < tiny)
+            c = tiny;
+        d = 1.0 / d;
+        double del = d * c;
+        h *= del;
+        if (std::fabs(del - 1.0) < eps)
+            break;
+    }
+    return h;
+}
+
+double ibeta(double a, double b, double x)
+{
+    if (x <= 0.0)
+        return 0.0;
+    if (x >= 1.0)
+        return 1.0;
+    double bt = std::exp(std::lgamma(a + b) - std::lgamma(a) -
+                         std::lgamma(b) + a * std::log(x) +
+                         b * std::log(1.0 - x));
+    if (x < (a + 1.0) / (a + b + 2.0))
+        return bt * betacf(a, b, x) / a;
+    return 1.0 - bt * betacf(b, a, 1.0 - x) / b;
+}
+
+// Two-sided p-value of Welch's t-test
+double welch_p(const Row &x, const Row &y)
+{
+    if (x.n < 2 || y.n < 2)
+        return 1.0;
+    double vx = x.sd * x.sd / x.n, vy = y.sd * y.sd / y.n;
+    if (vx + vy == 0.0)
+        return x.mean == y.mean ? 1.0 : 0.0;
+    double t = (x.mean - y.mean) / std::sqrt(vx + vy);
+    double df = (vx + vy) * (vx + vy) /
+        (vx * vx / (x.n - 1) + vy * vy / (y.n - 1));
+    return ibeta(df / 2.0, 0.5, df / (df + t * t));
+}
+
+void usage()
+{
+    std::cerr <<
+        "usage: bench_compare [options] base.csv new.csv\n"
+        "  --threshold X   throughput drop considered a regression (0.05)\n"
+        "  --alpha P       significance level (0.01)\n";
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    double threshold = 0.05, alpha = 0.01;
+    std::vector<const char *> paths;
+    for (int k = 1; k < argc; k++) {
+        if (!strcmp(argv[k], "--threshold") && k + 1 < argc)
+            threshold = atof(argv[++k]);
+        else if (!strcmp(argv[k], "--alpha") && k + 1 < argc)
+            alpha = atof(argv[++k]);
+        else if (argv[k][0] == '-')
+            usage();
+        else
+            paths.push_back(argv[k]);
+    }
+    if (paths.size() != 2)
+        usage();
+
+    std::map<Key, Row> base, next;
+    if (!load(paths[0], base) || !load(paths[1], next))
+        return 2;
+
+    int regressions = 0;
+    std::cout << "contestant,sample,size,base_gbps,new_gbps,change,p,verdict"
+        << std::endl;
+    for (auto &b: base) {
+        auto n = next.find(b.first);
+        if (n == next.end())
+            continue;
+        double change = n->second.mean / b.second.mean - 1.0;
+        std::cout << csv_field(std::get<0>(b.first)) << ","
+            << csv_field(std::get<1>(b.first)) << ","
+            << std::get<2>(b.first) << std::fixed << std::setprecision(3)
+            << "," << b.second.mean << "," << n->second.mean << ","
+            << std::showpos << change * 100 << "%" << std::noshowpos;
+        // single measurements (latency, threads, corpus totals) can't be
+        // tested
+        if (b.second.n < 2 || n->second.n < 2) {
+            std::cout << ",,n/a" << std::endl;
+            continue;
+        }
+        double p = welch_p(b.second, n->second);
+        const char *verdict = "same";
+        if (p < alpha && change < -threshold) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (p < alpha && change > threshold) {
+            verdict = "improvement";
+        }
+        std::cout << std::setprecision(4) << "," << p << "," << verdict
+            << std::endl;
+    }
+    if (regressions)
+        std::cerr << regressions << " regression(s)" << std::endl;
+    return regressions ? 1 : 0;
+}
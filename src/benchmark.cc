@@ -1,16 +1,43 @@
 #include "fix_utf8.h"
+#include "ticks.h"
 
-#include <sys/time.h> // gettimeofday TODO more c++ way
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#if __linux__
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#if __x86_64__ || __i386__
+#include <x86intrin.h>
+#endif
 #include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <cerrno>
+#if __GLIBC__
+#include <malloc.h>
+#endif
 
 #include <iostream>
+#include <fstream>
 #include <iomanip>
 #include <random>
 #include <string>
 #include <memory>
 #include <functional>
 #include <algorithm>
-#include <array>
+#include <unordered_map>
+#include <set>
+#include <numeric>
+#include <vector>
+#include <thread>
+#include <atomic>
 
 void sanity_check();
 
@@ -22,6 +49,8 @@ struct SGen
     SGen(): prio(1.0) {}
     virtual ~SGen() {}
     virtual void gen_next(std::string &out, Rnd &rnd) = 0;
+    // did every generator within this one contribute?
+    virtual bool all_used() const { return true; }
     void generate(std::string &out, size_t n, Rnd &rnd)
     {
         n += out.size();
@@ -63,7 +92,10 @@ struct Utf8: public SGen
     Utf8(long lo, long hi): gen_(lo, hi) {}
     virtual void gen_next(std::string &out, Rnd &rnd)
     {
-        long code = gen_(rnd);
+        encode(out, gen_(rnd));
+    }
+    static void encode(std::string &out, long code)
+    {
         if (code < 128) {
             out.push_back(code);
             return;
@@ -124,7 +156,8 @@ std::unique_ptr<SGen> utf8_substr(
 struct Mix: public SGen
 {
     Mix(std::vector<std::unique_ptr<SGen>> &&nodes):
-        gen_(0.0, prio_sum(nodes)), nodes_(std::move(nodes)) {}
+        gen_(0.0, prio_sum(nodes)), nodes_(std::move(nodes)),
+        used_(nodes_.size()) {}
     static double prio_sum(
             const std::vector<std::unique_ptr<SGen>> &nodes) {
         double sum = 0.0;
@@ -135,14 +168,27 @@ struct Mix: public SGen
     virtual void gen_next(std::string &out, Rnd &rnd)
     {
         double sel = gen_(rnd);
-        for (auto &node: nodes_) {
-            if (node->prio < sel)
-                return node->gen_next(out, rnd);
-            sel -= node->prio;
+        for (size_t k = 0; k < nodes_.size(); k++) {
+            if (sel < nodes_[k]->prio || k + 1 == nodes_.size()) {
+                size_t size = out.size();
+                nodes_[k]->gen_next(out, rnd);
+                used_[k] += out.size() - size;
+                return;
+            }
+            sel -= nodes_[k]->prio;
+        }
+    }
+    virtual bool all_used() const
+    {
+        for (size_t k = 0; k < nodes_.size(); k++) {
+            if (!used_[k] || !nodes_[k]->all_used())
+                return false;
         }
+        return true;
     }
     std::uniform_real_distribution<> gen_;
     std::vector<std::unique_ptr<SGen>> nodes_;
+    std::vector<size_t> used_;      // bytes generated by each node
 };
 
 // I am a dummy, what's the proper way of doing this stuff?
@@ -165,6 +211,272 @@ std::unique_ptr<SGen> mix(Args... args)
     return std::unique_ptr<SGen> (new Mix(std::move(nodes)));
 }
 
+// Words of letters in [lo, hi] (a letter is from [alt_lo, alt_hi] with
+// the probability alt), each followed by one of the separators
+struct Words: public SGen
+{
+    Words(long lo, long hi, int max_len, std::vector<std::string> seps,
+          long alt_lo, long alt_hi, double alt):
+        letter_(lo, hi), alt_letter_(alt_lo, alt_hi), len_(1, max_len),
+        sep_(0, seps.size() - 1), alt_(alt), seps_(std::move(seps)) {}
+    virtual void gen_next(std::string &out, Rnd &rnd)
+    {
+        for (int n = len_(rnd); n; n--) {
+            if (alt_(rnd))
+                Utf8::encode(out, alt_letter_(rnd));
+            else
+                Utf8::encode(out, letter_(rnd));
+        }
+        out += seps_[sep_(rnd)];
+    }
+    std::uniform_int_distribution<long> letter_, alt_letter_;
+    std::uniform_int_distribution<int> len_;
+    std::uniform_int_distribution<size_t> sep_;
+    std::bernoulli_distribution alt_;
+    std::vector<std::string> seps_;
+};
+
+// separators weighted by repetition
+const std::vector<std::string> ascii_seps = {
+    " ", " ", " ", " ", " ", " ", " ", " ", ", ", ". ", "\n" };
+
+// Latin with accents (mostly ASCII), Cyrillic, CJK, Arabic text
+std::unique_ptr<SGen> latin()
+{
+    return std::unique_ptr<SGen>(
+        new Words('a', 'z', 10, ascii_seps, 0xe0, 0xff, 0.04));
+}
+std::unique_ptr<SGen> cyrillic()
+{
+    return std::unique_ptr<SGen>(
+        new Words(0x430, 0x44f, 10, ascii_seps, 0x410, 0x42f, 0.02));
+}
+std::unique_ptr<SGen> cjk()
+{
+    // ideographs with fullwidth punctuation, hardly any spaces
+    return std::unique_ptr<SGen>(
+        new Words(0x4e00, 0x9fff, 20, {
+            "\xef\xbc\x8c", "\xe3\x80\x82", "\xe3\x80\x81", "\n" },
+            0x3041, 0x3096, 0.3));
+}
+std::unique_ptr<SGen> arabic()
+{
+    return std::unique_ptr<SGen>(
+        new Words(0x621, 0x64a, 8, ascii_seps, 0x660, 0x669, 0.02));
+}
+
+// Chat messages: ASCII words and emoji, incl. modifiers, ZWJ sequences,
+// variation selectors and flags
+struct Chat: public SGen
+{
+    Chat(): words_('a', 'z', 8, {" "}, 0, 0, 0.0), user_(1, 999),
+        len_(1, 15), emoji_(0.25), kind_(0, 4),
+        face_(0x1f600, 0x1f64f), thing_(0x1f300, 0x1f5ff),
+        tone_(0x1f3fb, 0x1f3ff), flag_(0x1f1e6, 0x1f1ff) {}
+    virtual void gen_next(std::string &out, Rnd &rnd)
+    {
+        out += "user" + std::to_string(user_(rnd)) + ": ";
+        for (int n = len_(rnd); n; n--) {
+            if (!emoji_(rnd)) {
+                words_.gen_next(out, rnd);
+                continue;
+            }
+            switch (kind_(rnd)) {
+                case 0:
+                    Utf8::encode(out, face_(rnd));
+                    break;
+                case 1:
+                    Utf8::encode(out, thing_(rnd));
+                    break;
+                case 2:
+                    // thumbs up, skin tone
+                    Utf8::encode(out, 0x1f44d);
+                    Utf8::encode(out, tone_(rnd));
+                    break;
+                case 3:
+                    // family, ZWJ sequence
+                    for (long c: {0x1f468, 0x200d, 0x1f469, 0x200d,
+                                  0x1f467})
+                        Utf8::encode(out, c);
+                    break;
+                case 4:
+                    // heart with VS16, a flag
+                    Utf8::encode(out, 0x2764);
+                    Utf8::encode(out, 0xfe0f);
+                    Utf8::encode(out, flag_(rnd));
+                    Utf8::encode(out, flag_(rnd));
+                    break;
+            }
+            out += " ";
+        }
+        out += "\n";
+    }
+    Words words_;
+    std::uniform_int_distribution<int> user_, len_;
+    std::bernoulli_distribution emoji_;
+    std::uniform_int_distribution<int> kind_;
+    std::uniform_int_distribution<long> face_, thing_, tone_, flag_;
+};
+
+std::unique_ptr<SGen> chat()
+{
+    return std::unique_ptr<SGen>(new Chat());
+}
+
+// Lines of C-like source code; comments and strings occasionally carry
+// accented text
+struct Code: public SGen
+{
+    Code(): text_('a', 'z', 8, {" "}, 0xe0, 0xff, 0.05), indent_(0, 3),
+        line_(0, 7), ident_(0, 15), num_(0, 4096) {}
+    virtual void gen_next(std::string &out, Rnd &rnd)
+    {
+        static const char *lines[] = {
+            "if (@ != @) {", "@ = @(@, #);", "return @;", "}",
+            "// $", "printf(\"$\\n\");", "for (int @ = 0; @ < #; @++) {",
+            "" };
+        out.append(4 * indent_(rnd), ' ');
+        for (const char *p = lines[line_(rnd)]; *p; p++) {
+            if (*p == '@')
+                out += ident(rnd);
+            else if (*p == '#')
+                out += std::to_string(num_(rnd));
+            else if (*p == '$') {
+                for (int n = 3; n; n--)
+                    text_.gen_next(out, rnd);
+            } else
+                out += *p;
+        }
+        out += "\n";
+    }
+    const char *ident(Rnd &rnd)
+    {
+        static const char *idents[] = {
+            "i", "n", "len", "buf", "result", "node", "count", "state",
+            "ptr", "end", "offset", "size", "data", "key", "value", "ctx" };
+        return idents[ident_(rnd)];
+    }
+    Words text_;
+    std::uniform_int_distribution<int> indent_, line_, ident_, num_;
+};
+
+std::unique_ptr<SGen> code()
+{
+    return std::unique_ptr<SGen>(new Code());
+}
+
+// HTTP access log lines (combined format); now and then a path or user
+// agent has a raw Latin-1 byte, invalid in UTF-8
+struct HttpLog: public SGen
+{
+    HttpLog(): octet_(1, 254), segs_(1, 5), seg_('a', 'z', 10, {""}, 0, 0,
+        0.0), latin1_(0.02), latin1_byte_(0xc0, 0xff), status_(0, 5),
+        size_(0, 100000), ua_(0, 2) {}
+    virtual void gen_next(std::string &out, Rnd &rnd)
+    {
+        static const char *statuses[] = {
+            "200", "200", "200", "304", "404", "500" };
+        static const char *uas[] = {
+            "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+                "(KHTML, like Gecko) Chrome/118.0 Safari/537.36",
+            "Mozilla/5.0 (iPhone; CPU iPhone OS 17_0 like Mac OS X) "
+                "Mobile/15E148",
+            "curl/8.4.0" };
+        for (int k = 0; k < 4; k++)
+            out += std::to_string(octet_(rnd)) + (k < 3 ? "." : "");
+        out += " - - [10/Oct/2023:13:55:36 +0000] \"GET ";
+        for (int n = segs_(rnd); n; n--) {
+            out += "/";
+            seg_.gen_next(out, rnd);
+            if (latin1_(rnd))
+                out += (char)latin1_byte_(rnd);
+        }
+        out += " HTTP/1.1\" ";
+        out += statuses[status_(rnd)];
+        out += " " + std::to_string(size_(rnd)) + " \"-\" \"";
+        out += uas[ua_(rnd)];
+        if (latin1_(rnd))
+            out += (char)latin1_byte_(rnd);
+        out += "\"\n";
+    }
+    std::uniform_int_distribution<int> octet_, segs_;
+    Words seg_;
+    std::bernoulli_distribution latin1_;
+    std::uniform_int_distribution<int> latin1_byte_, status_, size_, ua_;
+};
+
+std::unique_ptr<SGen> http_log()
+{
+    return std::unique_ptr<SGen>(new HttpLog());
+}
+
+// Records from the inner generator cut to a byte limit regardless of
+// sequence boundaries (ex: fixed width database columns), one per line
+struct Truncated: public SGen
+{
+    Truncated(std::unique_ptr<SGen> node, int max_len):
+        node_(std::move(node)), len_(8, max_len) {}
+    virtual void gen_next(std::string &out, Rnd &rnd)
+    {
+        size_t len = len_(rnd);
+        std::string rec;
+        while (rec.size() < len)
+            node_->gen_next(rec, rnd);
+        out.append(rec, 0, len);
+        out += "\n";
+    }
+    virtual bool all_used() const { return node_->all_used(); }
+    std::unique_ptr<SGen> node_;
+    std::uniform_int_distribution<int> len_;
+};
+
+std::unique_ptr<SGen> truncated(std::unique_ptr<SGen> node, int max_len = 64)
+{
+    return std::unique_ptr<SGen>(new Truncated(std::move(node), max_len));
+}
+
+// Byte level Markov chain of the given order trained on a file; keeps
+// invalid sequences of the training data
+struct Markov: public SGen
+{
+    Markov(const std::string &training, int order):
+        training_(training), order_(order)
+    {
+        for (size_t k = order; k < training.size(); k++)
+            next_[context(&training[k])] += training[k];
+    }
+    uint32_t context(const char *end)
+    {
+        uint32_t ctx = 0;
+        for (int k = order_; k; k--)
+            ctx = ctx << 8 | (unsigned char)end[-k];
+        return ctx;
+    }
+    virtual void gen_next(std::string &out, Rnd &rnd)
+    {
+        auto it = out.size() >= (size_t)order_ ?
+            next_.find(context(&out[0] + out.size())) : next_.end();
+        if (it == next_.end()) {
+            // (re)start at a random spot
+            size_t pos = std::uniform_int_distribution<size_t>(
+                0, training_.size() - order_ - 1)(rnd);
+            out.append(training_, pos, order_);
+            return;
+        }
+        const std::string &next = it->second;
+        out += next[std::uniform_int_distribution<size_t>(
+            0, next.size() - 1)(rnd)];
+    }
+    std::string training_;
+    int order_;
+    std::unordered_map<uint32_t, std::string> next_;
+};
+
+std::unique_ptr<SGen> markov(const std::string &training, int order = 3)
+{
+    return std::unique_ptr<SGen>(new Markov(training, order));
+}
+
 std::string make_sample(
     size_t sample_size,
     std::unique_ptr<SGen> node)
@@ -172,28 +484,699 @@ std::string make_sample(
     Rnd rnd;
     std::string res;
     node->generate(res, sample_size, rnd);
+    if (!node->all_used()) {
+        std::cerr << "sample generator: a part of a mix produced no bytes"
+            << std::endl;
+        abort();
+    }
     return res;
 }
 
-int main()
+// Timestamp counter (0 if unavailable); constant rate on modern x86,
+// close to core cycles when the frequency is fixed
+inline uint64_t tsc()
 {
-    sanity_check();
+#if __x86_64__ || __i386__
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
 
-    class Ts
+// Hardware counters (perf_event_open, user space only); a counter the
+// kernel or the CPU doesn't provide is skipped, fd = -1. The counters are
+// opened as one group so that they are scheduled together; if the PMU
+// multiplexes the group the counts are scaled by the share of time it
+// ran, if it never ran they are reported as unavailable from then on.
+struct PerfCounters
+{
+    enum { instructions, cycles, branch_misses, l1d_misses, llc_misses,
+           count };
+    static const char *name(int k)
     {
-        public:
-            Ts() { gettimeofday(&tv, 0); };
-            double operator - (const Ts &other)
-            {
-                timeval delta;
-                timersub(&tv, &other.tv, &delta);
-                return (double)delta.tv_sec + (double)delta.tv_usec *
-                    1e-6;
+        static const char *names[] = {
+            "instructions", "cycles", "branch-misses", "L1D-misses",
+            "LLC-misses" };
+        return names[k];
+    }
+    PerfCounters(): leader(-1), members(0), unscheduled(false)
+    {
+        for (int k = 0; k < count; k++)
+            fd[k] = -1;
+#if __linux__
+        static const struct { uint32_t type; uint64_t config; } events[] = {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        };
+        for (int k = 0; k < count; k++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof attr);
+            attr.size = sizeof attr;
+            attr.type = events[k].type;
+            attr.config = events[k].config;
+            // members follow the leader
+            attr.disabled = leader == -1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP |
+                PERF_FORMAT_TOTAL_TIME_ENABLED |
+                PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fd[k] = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+            if (fd[k] != -1) {
+                if (leader == -1)
+                    leader = fd[k];
+                // group members are read in the order they were added
+                slot[k] = members++;
             }
-        private:
-            timeval tv;
-    };
+        }
+#endif
+    }
+    ~PerfCounters()
+    {
+#if __linux__
+        for (int k = 0; k < count; k++) {
+            if (fd[k] != -1)
+                close(fd[k]);
+        }
+#endif
+    }
+    bool available(int k) const { return fd[k] != -1 && !unscheduled; }
+    void start()
+    {
+#if __linux__
+        if (leader != -1) {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+    void stop(uint64_t *values)
+    {
+        for (int k = 0; k < count; k++)
+            values[k] = 0;
+#if __linux__
+        if (leader == -1)
+            return;
+        ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        // PERF_FORMAT_GROUP layout: nr, time enabled, time running, values
+        uint64_t data[3 + count];
+        ssize_t size = (3 + members) * sizeof data[0];
+        if (read(leader, data, size) != size || data[0] != (uint64_t)members)
+            return;
+        uint64_t enabled = data[1], running = data[2];
+        if (!running) {
+            unscheduled = true;
+            return;
+        }
+        for (int k = 0; k < count; k++) {
+            if (fd[k] == -1)
+                continue;
+            values[k] = data[3 + slot[k]];
+            if (running < enabled)
+                values[k] = (uint64_t)((double)values[k] * enabled / running);
+        }
+#endif
+    }
+    int fd[count];
+    int slot[count];
+    int leader, members;
+    bool unscheduled;   // the group never got on the PMU
+};
+
+PerfCounters perf_counters;
+
+// Heap accounting: malloc and friends are interposed (glibc), counting
+// is on with --alloc only to keep timings undisturbed otherwise
+struct AllocCounters
+{
+    enum { mallocs, reallocs, frees, bytes, count };
+    std::atomic<size_t> n[count];
+    std::atomic<long> live, peak;   // usable bytes
+    void grow(long delta)
+    {
+        long cur = live.fetch_add(delta, std::memory_order_relaxed) + delta;
+        long prev = peak.load(std::memory_order_relaxed);
+        while (cur > prev &&
+               !peak.compare_exchange_weak(prev, cur,
+                                           std::memory_order_relaxed))
+            ;
+    }
+    void add(int k, size_t val = 1)
+    {
+        n[k].fetch_add(val, std::memory_order_relaxed);
+    }
+};
+
+bool alloc_accounting;
+AllocCounters alloc_counters;
+
+#if __GLIBC__
+// Every allocation function is interposed: memory from any of them ends
+// up in free (aligned operator new calls aligned_alloc in libstdc++)
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void *__libc_memalign(size_t, size_t);
+void *__libc_valloc(size_t);
+void *__libc_pvalloc(size_t);
+void __libc_free(void *);
+
+static void *count_alloc(void *p, size_t size)
+{
+    if (alloc_accounting && p) {
+        alloc_counters.add(AllocCounters::mallocs);
+        alloc_counters.add(AllocCounters::bytes, size);
+        alloc_counters.grow(malloc_usable_size(p));
+    }
+    return p;
+}
+
+void *malloc(size_t size)
+{
+    return count_alloc(__libc_malloc(size), size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    return count_alloc(__libc_calloc(n, size), n * size);
+}
+
+void *realloc(void *old, size_t size)
+{
+    long old_size = alloc_accounting && old ? malloc_usable_size(old) : 0;
+    void *p = __libc_realloc(old, size);
+    if (alloc_accounting && p) {
+        alloc_counters.add(AllocCounters::reallocs);
+        alloc_counters.add(AllocCounters::bytes, size);
+        alloc_counters.grow((long)malloc_usable_size(p) - old_size);
+    }
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return count_alloc(__libc_memalign(alignment, size), size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return count_alloc(__libc_memalign(alignment, size), size);
+}
+
+int posix_memalign(void **res, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) ||
+        (alignment & (alignment - 1)) || !alignment)
+        return EINVAL;
+    void *p = count_alloc(__libc_memalign(alignment, size), size);
+    if (!p && size)
+        return ENOMEM;
+    *res = p;
+    return 0;
+}
+
+void *valloc(size_t size)
+{
+    return count_alloc(__libc_valloc(size), size);
+}
+
+void *pvalloc(size_t size)
+{
+    return count_alloc(__libc_pvalloc(size), size);
+}
+
+void free(void *p)
+{
+    if (alloc_accounting && p) {
+        alloc_counters.add(AllocCounters::frees);
+        alloc_counters.grow(-(long)malloc_usable_size(p));
+    }
+    __libc_free(p);
+}
+}
+#endif
+
+// Peak resident set size since the last call, bytes (Linux: resets the
+// peak via clear_refs)
+size_t peak_rss(bool reset)
+{
+    size_t peak = 0, rss = 0;
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            peak = atol(line.c_str() + 6) * 1024;
+        else if (line.compare(0, 6, "VmRSS:") == 0)
+            rss = atol(line.c_str() + 6) * 1024;
+    }
+    if (reset) {
+        std::ofstream("/proc/self/clear_refs") << "5";
+        return rss;
+    }
+    return peak;
+}
+
+// Contestants start and stop the timer around the region of interest;
+// hardware counters belong to the main thread, others pass perf = false
+struct Timer
+{
+    Timer(bool perf = true): perf(perf) {}
+    bool perf;
+    timespec start_ts, stop_ts;
+    uint64_t start_tsc, stop_tsc;
+    uint64_t counters[PerfCounters::count];
+    size_t allocs[AllocCounters::count];
+    long live, peak;                // heap at start, growth peak
+    size_t out_size, out_capacity;  // see output()
+    void start()
+    {
+        out_size = out_capacity = 0;
+        if (alloc_accounting) {
+            for (int k = 0; k < AllocCounters::count; k++)
+                allocs[k] = alloc_counters.n[k];
+            live = alloc_counters.live;
+            alloc_counters.peak = live;
+        }
+        if (perf)
+            perf_counters.start();
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
+        start_tsc = tsc();
+    }
+    void stop()
+    {
+        stop_tsc = tsc();
+        clock_gettime(CLOCK_MONOTONIC_RAW, &stop_ts);
+        if (perf)
+            perf_counters.stop(counters);
+        if (alloc_accounting) {
+            for (int k = 0; k < AllocCounters::count; k++)
+                allocs[k] = alloc_counters.n[k] - allocs[k];
+            peak = alloc_counters.peak - live;
+        }
+    }
+    // the output buffer a contestant produced: size and capacity
+    void output(size_t size, size_t capacity)
+    {
+        out_size += size;
+        out_capacity += capacity;
+    }
+    double seconds() const
+    {
+        return (double)(stop_ts.tv_sec - start_ts.tv_sec) +
+            (double)(stop_ts.tv_nsec - start_ts.tv_nsec) * 1e-9;
+    }
+    double cycles() const { return (double)(stop_tsc - start_tsc); }
+};
+
+// Running mean and standard deviation (Welford)
+struct Stats
+{
+    Stats(): n(0), mean(0.0), m2(0.0) {}
+    void add(double x)
+    {
+        n++;
+        double d = x - mean;
+        mean += d / n;
+        m2 += d * (x - mean);
+    }
+    double sd() const { return n > 1 ? std::sqrt(m2 / (n - 1)) : 0.0; }
+    // half-width of the 95% confidence interval of the mean
+    double ci95() const
+    {
+        // two-sided t quantiles, n-1 degrees of freedom
+        static const double t[] = {
+            0, 12.71, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+            2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110,
+            2.101, 2.093, 2.086 };
+        if (n < 2)
+            return HUGE_VAL;
+        double q = n - 1 < sizeof t / sizeof t[0] ? t[n - 1] :
+            n - 1 < 60 ? 2.0 : 1.96;
+        return q * sd() / std::sqrt((double)n);
+    }
+    size_t n;
+    double mean, m2;
+};
+
+struct Options
+{
+    Options(): cpu(-1), warmup(2), min_reps(5), max_reps(200),
+        ci(0.01), max_time(1.0), sweep(false), threads(false), alloc(false),
+        latency(false), strings(1000000),
+        max_threads(0), max_size(64 << 20),
+        format(text) {}
+    int cpu;            // pin to this CPU (-1: the one we started on)
+    int warmup;         // untimed runs per cell
+    int min_reps, max_reps;
+    double ci;          // target 95% CI half-width, relative to the mean
+    double max_time;    // time budget per cell, seconds
+    bool sweep;         // input size sweep instead of the 8MB table
+    bool threads;       // multi-threaded scaling instead of the table
+    bool alloc;         // heap and RSS accounting
+    bool latency;       // short strings, per call latency
+    size_t strings;     // in the latency benchmark
+    int max_threads;    // (0: every CPU available)
+    size_t max_size;    // largest input in the sweep
+    enum { text, csv, json } format;
+    std::string markov; // train a Markov generator on this file
+    std::vector<std::string> corpus;    // files or directories
+    std::string adversarial;            // fuzz_throughput output
+};
+
+void usage()
+{
+    std::cerr <<
+        "usage: benchmark [options]\n"
+        "  --cpu N         pin to CPU N (default: the current one)\n"
+        "  --warmup N      untimed runs per measurement (2)\n"
+        "  --min-reps N    (5)\n"
+        "  --max-reps N    (200)\n"
+        "  --ci X          stop once the 95% confidence interval is\n"
+        "                  within X of the mean (0.01)\n"
+        "  --max-time S    time budget per measurement, seconds (1)\n"
+        "  --sweep         input sizes from 16B to 1GB\n"
+        "  --threads       aggregate throughput of 1 .. max threads\n"
+        "  --max-threads N (every CPU available)\n"
+        "  --alloc         count allocations, peak heap and RSS\n"
+        "                  (not with --threads)\n"
+        "  --latency       per call latency on short strings\n"
+        "  --strings N     strings in the latency benchmark (1000000)\n"
+        "  --max-size N    largest size in the sweep, K/M/G suffixes (64M)\n"
+        "  --format F      text, csv or json (text)\n"
+        "  --markov FILE   add a sample generated by a Markov chain\n"
+        "                  trained on FILE\n"
+        "  --corpus PATH   add the file or every file in the directory\n"
+        "                  as samples (repeatable)\n"
+        "  --adversarial DIR\n"
+        "                  add inputs found by fuzz_throughput, tiled\n";
+    exit(2);
+}
+
+// 16, 4K, 64M, 1G
+size_t parse_size(const char *val)
+{
+    char *suffix;
+    size_t size = strtoull(val, &suffix, 10);
+    switch (*suffix) {
+        case 'G': size <<= 10; // fallthrough
+        case 'M': size <<= 10; // fallthrough
+        case 'K': size <<= 10;
+    }
+    return size;
+}
+
+std::string format_size(size_t size)
+{
+    static const char suffix[] = " KMG";
+    int k = 0;
+    while (size >= 1024 && size % 1024 == 0 && k < 3) {
+        size /= 1024;
+        k++;
+    }
+    return std::to_string(size) + (k ? std::string(1, suffix[k]) : "");
+}
+
+Options parse_options(int argc, char **argv)
+{
+    Options opts;
+    for (int k = 1; k < argc; k++) {
+        std::string arg = argv[k];
+        if (arg == "--sweep") {
+            opts.sweep = true;
+            continue;
+        }
+        if (arg == "--threads") {
+            opts.threads = true;
+            continue;
+        }
+        if (arg == "--alloc") {
+            opts.alloc = true;
+            continue;
+        }
+        if (arg == "--latency") {
+            opts.latency = true;
+            continue;
+        }
+        if (k + 1 == argc)
+            usage();
+        const char *val = argv[++k];
+        if (arg == "--cpu")
+            opts.cpu = atoi(val);
+        else if (arg == "--warmup")
+            opts.warmup = atoi(val);
+        else if (arg == "--min-reps")
+            opts.min_reps = std::max(2, atoi(val));
+        else if (arg == "--max-reps")
+            opts.max_reps = atoi(val);
+        else if (arg == "--ci")
+            opts.ci = atof(val);
+        else if (arg == "--max-time")
+            opts.max_time = atof(val);
+        else if (arg == "--strings")
+            opts.strings = std::max(1L, atol(val));
+        else if (arg == "--max-threads")
+            opts.max_threads = atoi(val);
+        else if (arg == "--max-size")
+            opts.max_size = parse_size(val);
+        else if (arg == "--format" && !strcmp(val, "text"))
+            opts.format = Options::text;
+        else if (arg == "--format" && !strcmp(val, "csv"))
+            opts.format = Options::csv;
+        else if (arg == "--format" && !strcmp(val, "json"))
+            opts.format = Options::json;
+        else if (arg == "--markov")
+            opts.markov = val;
+        else if (arg == "--corpus")
+            opts.corpus.push_back(val);
+        else if (arg == "--adversarial")
+            opts.adversarial = val;
+        else
+            usage();
+    }
+    opts.max_reps = std::max(opts.max_reps, opts.min_reps);
+    // the counters are process-wide, timers in concurrent threads would
+    // see each other's allocations
+    if (opts.threads && opts.alloc) {
+        std::cerr << "warning: --alloc is ignored with --threads"
+            << std::endl;
+        opts.alloc = false;
+    }
+    return opts;
+}
+
+// Keep off the scheduler's migrations, caches and TSC stay put
+void pin_cpu(int cpu)
+{
+#if __linux__
+    if (cpu < 0)
+        cpu = sched_getcpu();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (cpu < 0 || sched_setaffinity(0, sizeof set, &set) != 0)
+        std::cerr << "warning: failed to pin to CPU " << cpu << std::endl;
+#endif
+}
+
+// CPUs we may run on (before pinning)
+std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+#if __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        }
+    }
+#endif
+    if (cpus.empty())
+        cpus.push_back(-1);
+    return cpus;
+}
+
+// Fix [i, end) calls times in a row, the timer covers all of the calls
+typedef std::function<void(
+    Timer &, const unsigned char *, const unsigned char *, size_t calls)>
+    Contestant;
+
+struct Result
+{
+    Result(): bytes(0), rss(0), p50(0), p99(0), p999(0) {}
+    size_t bytes;       // per measurement
+    Stats gbps;         // GB/s
+    Stats cpb;          // TSC cycles per byte
+    Stats ns_per_call;
+    Stats counters[PerfCounters::count];    // per byte
+    Stats allocs[AllocCounters::count];     // per call
+    Stats peak_heap;    // heap growth peak per measurement
+    Stats slack;        // output capacity / size
+    size_t rss;         // peak RSS growth over all runs
+    double p50, p99, p999;  // per call latency, ns
+};
+
+// Repeat until the confidence interval is tight (or out of budget)
+Result measure(const Options &opts, const Contestant &contestant,
+               const unsigned char *i, const unsigned char *end,
+               size_t calls = 1)
+{
+    Result res;
+    res.bytes = (end - i) * calls;
+    size_t rss = alloc_accounting ? peak_rss(true) : 0;
+    Timer timer;
+    for (int k = 0; k < opts.warmup; k++)
+        contestant(timer, i, end, calls);
+    double total = 0.0;
+    while (res.gbps.n < (size_t)opts.max_reps) {
+        contestant(timer, i, end, calls);
+        total += timer.seconds();
+        res.gbps.add(res.bytes / timer.seconds() * 1e-9);
+        res.cpb.add(timer.cycles() / res.bytes);
+        res.ns_per_call.add(timer.seconds() / calls * 1e9);
+        for (int k = 0; k < PerfCounters::count; k++)
+            res.counters[k].add((double)timer.counters[k] / res.bytes);
+        if (alloc_accounting) {
+            for (int k = 0; k < AllocCounters::count; k++)
+                res.allocs[k].add((double)timer.allocs[k] / calls);
+            res.peak_heap.add(timer.peak);
+            if (timer.out_size)
+                res.slack.add((double)timer.out_capacity / timer.out_size);
+        }
+        if (res.gbps.n >= (size_t)opts.min_reps &&
+            (res.gbps.ci95() <= opts.ci * res.gbps.mean ||
+             total >= opts.max_time))
+            break;
+    }
+    if (alloc_accounting) {
+        size_t peak = peak_rss(false);
+        res.rss = peak > rss ? peak - rss : 0;
+    }
+    return res;
+}
+
+// A result with its coordinates, for machine-readable output
+struct Record
+{
+    std::string contestant, sample;
+    size_t size;        // input size per call
+    Result res;
+};
+
+// "malloc  " -> malloc, "\"Unicode(evil mix)\"" -> Unicode(evil mix)
+std::string plain_name(const std::string &name)
+{
+    size_t b = name.find_first_not_of(" \"");
+    size_t e = name.find_last_not_of(" \"");
+    return b == std::string::npos ? "" : name.substr(b, e - b + 1);
+}
+
+// A named input; generated samples own the data, corpus files are mapped
+struct Sample
+{
+    Sample(const std::string &name, std::string data):
+        name(name), data(std::move(data)), map_size(0) {}
+    Sample(const std::string &name, std::shared_ptr<void> mapping,
+           size_t size):
+        name(name), mapping(mapping), map_size(size) {}
+    const unsigned char *begin() const
+    {
+        return reinterpret_cast<const unsigned char *>(
+            mapping ? mapping.get() : data.c_str());
+    }
+    const unsigned char *end() const { return begin() + size(); }
+    size_t size() const { return mapping ? map_size : data.size(); }
+    bool corpus() const { return !!mapping; }
+    std::string name;
+    std::string data;
+    std::shared_ptr<void> mapping;
+    size_t map_size;
+};
+
+typedef std::vector<Sample> Samples;
+
+// Repeat the sample to the size requested
+std::string tile(const Sample &sample, size_t size)
+{
+    std::string res;
+    res.reserve(size);
+    while (res.size() < size)
+        res.append(reinterpret_cast<const char *>(sample.begin()),
+                   std::min(sample.size(), size - res.size()));
+    return res;
+}
+
+// mmap a file (read-only), empty files are skipped
+void map_file(const std::string &path, Samples &samples)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        exit(2);
+    }
+    size_t size = st.st_size;
+    void *p = size ? mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+    close(fd);
+    if (!size)
+        return;
+    if (p == MAP_FAILED) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        exit(2);
+    }
+    samples.push_back(Sample("\"" + path + "\"",
+        std::shared_ptr<void>(p, [size](void *p) { munmap(p, size); }),
+        size));
+}
 
+// Directories already walked, by (device, inode): symlinks may form cycles
+typedef std::set<std::pair<dev_t, ino_t> > Visited;
+
+// A file or every file in a directory tree (sorted by name); a directory
+// reached again (through a symlink) is skipped
+void map_corpus(const std::string &path, Samples &samples, Visited &visited)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        std::cerr << path << ": " << strerror(errno) << std::endl;
+        exit(2);
+    }
+    if (!S_ISDIR(st.st_mode))
+        return map_file(path, samples);
+    if (!visited.insert(std::make_pair(st.st_dev, st.st_ino)).second)
+        return;
+    std::vector<std::string> names;
+    if (DIR *dir = opendir(path.c_str())) {
+        while (dirent *ent = readdir(dir)) {
+            if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
+                names.push_back(ent->d_name);
+        }
+        closedir(dir);
+    }
+    std::sort(names.begin(), names.end());
+    for (auto &name: names) {
+        map_corpus(path + "/" + name, samples, visited);
+    }
+}
+
+void map_corpus(const std::string &path, Samples &samples)
+{
+    Visited visited;
+    map_corpus(path, samples, visited);
+}
+
+typedef std::vector<std::pair<std::string, Contestant>> Contestants;
+
+Samples make_samples(const Options &opts)
+{
     std::cerr << "Generating samples..." << std::endl;
 
     const size_t sample_size = 8 * 1024 * 1024;
@@ -205,7 +1188,14 @@ int main()
     // utf8_substr(...) -         truncated UTF-8 encoding (invalid)
     // mix(...) -                 combine several generators
     // priority(val, gen) -       use in mix
-    const std::vector<std::pair<std::string, std::string>> samples = {
+    // latin(), cyrillic(),
+    // cjk(), arabic() -          text in the script
+    // chat() -                   chat messages with emoji
+    // code() -                   C-like source code
+    // http_log() -               access log, occasional Latin-1 bytes
+    // truncated(gen, opt len) -  records cut at a byte limit
+    // markov(training) -         Markov chain trained on a file
+    Samples samples {
 
         {"ASCII", make_sample(sample_size,
             bytes(0, 127))},
@@ -235,103 +1225,839 @@ int main()
 
         {"Random", make_sample(sample_size,
             bytes())},
+
+        {"Latin", make_sample(sample_size,
+            latin())},
+
+        {"Cyrillic", make_sample(sample_size,
+            cyrillic())},
+
+        {"CJK", make_sample(sample_size,
+            cjk())},
+
+        {"Arabic", make_sample(sample_size,
+            arabic())},
+
+        {"\"Emoji chat\"", make_sample(sample_size,
+            chat())},
+
+        {"\"Source code\"", make_sample(sample_size,
+            code())},
+
+        {"\"HTTP log\"", make_sample(sample_size,
+            http_log())},
+
+        {"\"Truncated records\"", make_sample(sample_size,
+            truncated(
+                mix(latin(), cyrillic(), cjk(), chat())))},
     };
 
-    // Contestants
-    const std::vector<std::pair<
-        std::string,
-        std::function<double(const unsigned char *, const unsigned char *)>>>
-            contestants = {
+    if (!opts.markov.empty()) {
+        std::ifstream in(opts.markov, std::ios::binary);
+        std::string training(
+            (std::istreambuf_iterator<char>(in)),
+            std::istreambuf_iterator<char>());
+        if (training.size() < 16) {
+            std::cerr << opts.markov << ": can't read or too short"
+                << std::endl;
+            exit(2);
+        }
+        samples.push_back({"\"Markov(" + opts.markov + ")\"",
+            make_sample(sample_size, markov(training))});
+    }
+
+    for (auto &path: opts.corpus) {
+        map_corpus(path, samples);
+    }
+
+    // worst cases are short patterns, tiled like in fuzz_throughput
+    if (!opts.adversarial.empty()) {
+        Samples found;
+        map_corpus(opts.adversarial, found);
+        for (auto &sample: found) {
+            std::string name = plain_name(sample.name);
+            name = name.substr(name.rfind('/') + 1);
+            name = name.substr(0, name.rfind('.'));
+            samples.push_back({"\"adversarial " + name + "\"",
+                tile(sample, sample_size)});
+        }
+    }
+    return samples;
+}
 
-                {"baseline", [](
-                    const unsigned char *i, const unsigned char *end) {
+Contestants make_contestants()
+{
+    return Contestants {
+
+                {"baseline", [](Timer &timer,
+                    const unsigned char *i, const unsigned char *end,
+                    size_t calls) {
                         std::vector<unsigned char>buf;
                         buf.resize((end - i)*3);
 
-                        Ts start_ts;
-                        fix_utf8(&buf[0], i, end);
-                        Ts stop_ts;
-
-                        return stop_ts - start_ts;
+                        timer.start();
+                        size_t size = 0;
+                        for (size_t k = 0; k < calls; k++)
+                            size = fix_utf8(&buf[0], i, end);
+                        timer.stop();
+                        timer.output(size * calls, buf.size() * calls);
                 }},
 
-                {"malloc  ", [](
-                    const unsigned char *i, const unsigned char *end) {
-                        Ts start_ts;
-                        void *p;
-                        fix_utf8(&p, i, end);
-                        Ts stop_ts;
-                        free(p);
-                        return stop_ts - start_ts;
+                {"malloc  ", [](Timer &timer,
+                    const unsigned char *i, const unsigned char *end,
+                    size_t calls) {
+                        std::vector<void *> p(calls);
+                        std::vector<size_t> size(calls);
+                        timer.start();
+                        for (size_t k = 0; k < calls; k++)
+                            size[k] = fix_utf8(&p[k], i, end);
+                        timer.stop();
+                        for (size_t k = 0; k < calls; k++) {
+#if __GLIBC__
+                            timer.output(size[k], malloc_usable_size(p[k]));
+#endif
+                            free(p[k]);
+                        }
                 }},
 
-                {"string  ", [](
-                    const unsigned char *i, const unsigned char *end) {
-                        Ts start_ts;
-                        std::string res;
-                        fix_utf8(res, i, end);
-                        Ts stop_ts;
-                        return stop_ts - start_ts;
+                {"string  ", [](Timer &timer,
+                    const unsigned char *i, const unsigned char *end,
+                    size_t calls) {
+                        std::vector<std::string> res(calls);
+                        timer.start();
+                        for (size_t k = 0; k < calls; k++)
+                            fix_utf8(res[k], i, end);
+                        timer.stop();
+                        for (auto &r: res) {
+                            timer.output(r.size(), r.capacity());
+                        }
                 }},
 
-                {"vector  ", [](
-                    const unsigned char *i, const unsigned char *end) {
-                        Ts start_ts;
-                        std::vector<unsigned char> res;
-                        fix_utf8(res, i, end);
-                        Ts stop_ts;
-                        return stop_ts - start_ts;
+                {"vector  ", [](Timer &timer,
+                    const unsigned char *i, const unsigned char *end,
+                    size_t calls) {
+                        std::vector<std::vector<unsigned char>> res(calls);
+                        timer.start();
+                        for (size_t k = 0; k < calls; k++)
+                            fix_utf8(res[k], i, end);
+                        timer.stop();
+                        for (auto &r: res) {
+                            timer.output(r.size(), r.capacity());
+                        }
                 }},
 
 #if 0
                 // process in malloc buffer and then copy to string
-                {"retarded", [](
-                    const unsigned char *i, const unsigned char *end) {
-                        Ts start_ts;
+                {"retarded", [](Timer &timer,
+                    const unsigned char *i, const unsigned char *end,
+                    size_t calls) {
+                        timer.start();
                         void *p;
                         size_t res = fix_utf8(&p, i, end);
                         std::string copy((const char *)p, res);
                         free(p);
-                        Ts stop_ts;
-                        return stop_ts - start_ts;
+                        timer.stop();
                 }},
 #endif
 
             };
+}
 
+// A row of results per name, cell prints a result
+void print_table(const std::string &title,
+                 const std::vector<std::string> &columns,
+                 const std::vector<std::string> &rows,
+                 const std::vector<std::vector<Result>> &results,
+                 const std::function<void(const Result &)> &cell)
+{
+    std::cout << "# " << title << std::endl;
     std::cout << "#";
-    for (auto &sample: samples) {
-        std::cout << " " << sample.first;
+    for (auto &column: columns) {
+        std::cout << " " << column;
     }
     std::cout << std::endl;
+    for (size_t r = 0; r < rows.size(); r++) {
+        std::cout << rows[r];
+        for (auto &res: results[r]) {
+            std::cout << "\t ";
+            cell(res);
+        }
+        std::cout << std::endl;
+    }
+}
+
+// One row per contestant
+void print_table(const std::string &title,
+                 const std::vector<std::string> &columns,
+                 const Contestants &contestants,
+                 const std::vector<std::vector<Result>> &results,
+                 const std::function<void(const Result &)> &cell)
+{
+    std::vector<std::string> rows;
+    for (auto &contestant: contestants) {
+        rows.push_back(contestant.first);
+    }
+    print_table(title, columns, rows, results, cell);
+}
 
+void run_table(const Options &opts, const Samples &samples,
+               const Contestants &contestants, std::vector<Record> &records)
+{
+    std::vector<std::vector<Result>> results;
     for (auto &contestant: contestants) {
 
-        std::cout << contestant.first;
+        results.emplace_back();
+
+        // corpus totals: bytes, time, cycles and counters
+        size_t corpus_bytes = 0;
+        double corpus_sec = 0.0, corpus_cycles = 0.0;
+        double corpus_counters[PerfCounters::count] = {};
 
         for (auto &sample: samples) {
 
-            const unsigned char *i =
-                reinterpret_cast<const unsigned char *>(
-                    sample.second.c_str());
-            const unsigned char *end = i + sample.second.size();
+            // small files are fixed in batches of about 64KB
+            size_t calls = std::max<size_t>(1, 64 * 1024 / sample.size());
+            results.back().push_back(
+                measure(opts, contestant.second,
+                        sample.begin(), sample.end(), calls));
+            const Result &res = results.back().back();
+            records.push_back(Record {
+                plain_name(contestant.first), plain_name(sample.name),
+                sample.size(), res });
+            if (sample.corpus()) {
+                corpus_bytes += sample.size();
+                corpus_sec += res.ns_per_call.mean * 1e-9;
+                corpus_cycles += res.cpb.mean * sample.size();
+                for (int k = 0; k < PerfCounters::count; k++)
+                    corpus_counters[k] += res.counters[k].mean * sample.size();
+            }
+        }
+
+        if (corpus_bytes) {
+            // as if every file was fixed once
+            Result total;
+            total.bytes = corpus_bytes;
+            total.gbps.add(corpus_bytes / corpus_sec * 1e-9);
+            total.ns_per_call.add(corpus_sec * 1e9);
+            total.cpb.add(corpus_cycles / corpus_bytes);
+            for (int k = 0; k < PerfCounters::count; k++)
+                total.counters[k].add(corpus_counters[k] / corpus_bytes);
+            results.back().push_back(total);
+            records.push_back(Record {
+                plain_name(contestant.first), "corpus total",
+                corpus_bytes, total });
+        }
+    }
 
-            const int N = 7;
-            std::array<double, N> res;
-            for (int j=0; j<N; j++)
-                res[j] = contestant.second(i, end);
+    if (opts.format != Options::text)
+        return;
 
-            std::sort(res.begin(), res.end());
+    std::vector<std::string> columns;
+    for (auto &sample: samples) {
+        columns.push_back(sample.name);
+    }
+    if (results[0].size() > samples.size())
+        columns.push_back("\"corpus total\"");
 
-            double avg =
-                std::accumulate(res.begin()+1, res.end()-1, 0.0) / (res.size()-2);
+    std::cout << std::fixed;
+    print_table("GB/s (mean, stddev)", columns, contestants, results,
+        [](const Result &res) {
+            std::cout << std::setprecision(3)
+                << res.gbps.mean << " " << res.gbps.sd();
+        });
 
-            std::cout << "\t " << std::fixed << std::setprecision(5) << avg;
+    print_table("cycles/byte (TSC; mean, stddev)", columns, contestants,
+        results, [](const Result &res) {
+            std::cout << std::setprecision(3)
+                << res.cpb.mean << " " << res.cpb.sd();
+        });
+
+    for (int k = 0; k < PerfCounters::count; k++) {
+        std::string title = PerfCounters::name(k) + std::string("/byte");
+        if (!perf_counters.available(k)) {
+            std::cout << "# " << title << ": unavailable" << std::endl;
+            continue;
         }
+        print_table(title + " (mean)", columns, contestants, results,
+            [k](const Result &res) {
+                std::cout << std::setprecision(4) << res.counters[k].mean;
+            });
+    }
 
+    if (perf_counters.available(PerfCounters::instructions) &&
+        perf_counters.available(PerfCounters::cycles)) {
+        print_table("IPC", columns, contestants, results,
+            [](const Result &res) {
+                std::cout << std::setprecision(2)
+                    << res.counters[PerfCounters::instructions].mean /
+                       res.counters[PerfCounters::cycles].mean;
+            });
+    }
+
+    if (!opts.alloc)
+        return;
+
+    print_table("allocations per call: malloc realloc free", columns,
+        contestants, results, [](const Result &res) {
+            std::cout << std::setprecision(1)
+                << res.allocs[AllocCounters::mallocs].mean << " "
+                << res.allocs[AllocCounters::reallocs].mean << " "
+                << res.allocs[AllocCounters::frees].mean;
+        });
+    print_table("bytes requested per call, MB", columns, contestants,
+        results, [](const Result &res) {
+            std::cout << std::setprecision(2)
+                << res.allocs[AllocCounters::bytes].mean / (1 << 20);
+        });
+    print_table("peak heap growth, MB", columns, contestants, results,
+        [](const Result &res) {
+            std::cout << std::setprecision(2)
+                << res.peak_heap.mean / (1 << 20);
+        });
+    print_table("over-allocation: output capacity / size", columns,
+        contestants, results, [](const Result &res) {
+            std::cout << std::setprecision(3) << res.slack.mean;
+        });
+    print_table("peak RSS growth, MB", columns, contestants, results,
+        [](const Result &res) {
+            std::cout << std::setprecision(2) << (double)res.rss / (1 << 20);
+        });
+}
+
+// Throughput by input size, shows cache level transitions and the fixed
+// cost per call (small inputs are fixed in batches of about 64KB)
+void run_sweep(const Options &opts, const Samples &samples,
+               const Contestants &contestants, std::vector<Record> &records)
+{
+    static const size_t all_sizes[] = {
+        16, 64, 256, 4 << 10, 64 << 10, 1 << 20, 64 << 20, 1 << 30 };
+    std::vector<size_t> sizes;
+    for (size_t size: all_sizes) {
+        if (size <= opts.max_size)
+            sizes.push_back(size);
+    }
+    std::vector<std::string> columns;
+    for (size_t size: sizes) {
+        columns.push_back(format_size(size));
+    }
+
+    std::cout << std::fixed;
+    for (auto &sample: samples) {
+
+        std::vector<std::vector<Result>> results(contestants.size());
+
+        for (size_t size: sizes) {
+            std::string tiled;
+            const unsigned char *i = sample.begin();
+            if (size > sample.size()) {
+                tiled = tile(sample, size);
+                i = reinterpret_cast<const unsigned char *>(tiled.c_str());
+            }
+            size_t calls = std::max<size_t>(1, 64 * 1024 / size);
+            for (size_t c = 0; c < contestants.size(); c++) {
+                results[c].push_back(
+                    measure(opts, contestants[c].second, i, i + size,
+                            calls));
+                records.push_back(Record {
+                    plain_name(contestants[c].first),
+                    plain_name(sample.name), size, results[c].back() });
+            }
+        }
+
+        if (opts.format != Options::text)
+            continue;
+
+        print_table("sweep " + sample.name + ": GB/s (mean)", columns,
+            contestants, results, [](const Result &res) {
+                std::cout << std::setprecision(3) << res.gbps.mean;
+            });
+        print_table("sweep " + sample.name + ": ns/call (mean)", columns,
+            contestants, results, [](const Result &res) {
+                std::cout << std::setprecision(1) << res.ns_per_call.mean;
+            });
+    }
+}
+
+// K threads fix the sample concurrently, each reps times, with an own
+// copy of the input or all sharing one; returns the sum of per thread
+// throughputs (threads start together, their timed regions overlap).
+// Own copies are allocated and filled by their threads once pinned, so
+// that first touch puts them on the thread's NUMA node.
+double run_threads_once(const Contestant &contestant, const Sample &sample,
+                        int threads, bool shared, size_t reps,
+                        const std::vector<int> &cpus)
+{
+    std::vector<std::string> copies(shared ? 0 : threads);
+    std::vector<double> gbps(threads);
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> pool;
+    for (int k = 0; k < threads; k++) {
+        pool.emplace_back([&, k]() {
+            pin_cpu(cpus[k % cpus.size()]);
+            if (!shared) {
+                copies[k].assign(
+                    reinterpret_cast<const char *>(sample.begin()),
+                    sample.size());
+            }
+            const unsigned char *i = shared ? sample.begin() :
+                reinterpret_cast<const unsigned char *>(copies[k].c_str());
+            const unsigned char *end = i + sample.size();
+            Timer timer(false);
+            contestant(timer, i, end, 1);   // warmup
+            ready++;
+            while (!go)
+                std::this_thread::yield();
+            double sec = 0.0;
+            for (size_t r = 0; r < reps; r++) {
+                contestant(timer, i, end, 1);
+                sec += timer.seconds();
+            }
+            gbps[k] = reps * sample.size() / sec * 1e-9;
+        });
+    }
+    while (ready < threads)
+        std::this_thread::yield();
+    go = true;
+    for (auto &thread: pool) {
+        thread.join();
+    }
+    return std::accumulate(gbps.begin(), gbps.end(), 0.0);
+}
+
+// Aggregate throughput for K = 1, 2, 4 .. max threads: where does the
+// memory bandwidth run out
+void run_threads(const Options &opts, const Samples &samples,
+                 const Contestants &contestants, const std::vector<int> &cpus,
+                 std::vector<Record> &records)
+{
+    int max_threads = opts.max_threads > 0 ? opts.max_threads : cpus.size();
+    std::vector<int> counts;
+    for (int k = 1; k < max_threads; k *= 2) {
+        counts.push_back(k);
+    }
+    counts.push_back(max_threads);
+    std::vector<std::string> columns;
+    for (int k: counts) {
+        columns.push_back(std::to_string(k));
+    }
+
+    std::cout << std::fixed;
+    for (auto &sample: samples) {
+
+        std::vector<std::string> rows;
+        std::vector<std::vector<Result>> results;
+
+        for (auto &contestant: contestants) {
+
+            // about max_time / 4 per thread count and mode
+            Timer timer;
+            contestant.second(timer, sample.begin(), sample.end(), 1);
+            size_t reps = std::max(1.0, opts.max_time / 4 / timer.seconds());
+
+            for (bool shared: {false, true}) {
+                const char *mode = shared ? "shared" : "own";
+                rows.push_back(plain_name(contestant.first) + " " + mode);
+                results.emplace_back();
+                for (int k: counts) {
+                    Result res;
+                    res.bytes = sample.size() * reps * k;
+                    res.gbps.add(run_threads_once(
+                        contestant.second, sample, k, shared, reps, cpus));
+                    results.back().push_back(res);
+                    records.push_back(Record {
+                        plain_name(contestant.first) + " " + mode + " x" +
+                            std::to_string(k),
+                        plain_name(sample.name), sample.size(), res });
+                }
+            }
+        }
+
+        if (opts.format != Options::text)
+            continue;
+
+        print_table("threads " + sample.name + ": aggregate GB/s",
+            columns, rows, results, [](const Result &res) {
+                std::cout << std::setprecision(3) << res.gbps.mean;
+            });
+    }
+}
+
+double ns_per_tick()
+{
+    timespec start_ts, stop_ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
+    uint64_t start = ticks();
+    do {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &stop_ts);
+    } while (stop_ts.tv_sec - start_ts.tv_sec < 1 &&
+             (stop_ts.tv_sec - start_ts.tv_sec) * 1000000000l +
+             stop_ts.tv_nsec - start_ts.tv_nsec < 50000000l);
+    uint64_t stop = ticks();
+    return ((stop_ts.tv_sec - start_ts.tv_sec) * 1e9 +
+            (stop_ts.tv_nsec - start_ts.tv_nsec)) / (stop - start);
+}
+
+// Short strings cut from a sample at random
+struct ShortStrings
+{
+    std::vector<const unsigned char *> begin;
+    std::vector<size_t> size;
+};
+
+// Lengths are log-normal with the median of 24 bytes (most fields are
+// 20-500 bytes), at most 1KB
+ShortStrings make_short_strings(const Sample &sample, size_t n)
+{
+    Rnd rnd;
+    std::lognormal_distribution<> len(std::log(24.0), 0.9);
+    ShortStrings res;
+    for (size_t k = 0; k < n; k++) {
+        size_t size = std::min<size_t>(
+            std::min(1024.0, std::max(1.0, len(rnd))), sample.size());
+        size_t off = std::uniform_int_distribution<size_t>(
+            0, sample.size() - size)(rnd);
+        res.begin.push_back(sample.begin() + off);
+        res.size.push_back(size);
+    }
+    return res;
+}
+
+// Time every call of f(i, end) separately, ticks
+template <typename F>
+void time_calls(const ShortStrings &strings, std::vector<uint64_t> &lat,
+                F f)
+{
+    for (size_t k = 0; k < strings.size.size(); k++) {
+        const unsigned char *i = strings.begin[k];
+        const unsigned char *end = i + strings.size[k];
+        uint64_t start = ticks();
+        f(i, end);
+        lat[k] = ticks() - start;
+    }
+}
+
+__attribute__((noinline))
+void empty_call(std::string &result, const unsigned char *i,
+                const unsigned char *end)
+{
+    __asm__ volatile("" ::: "memory");
+}
+
+typedef std::vector<std::pair<std::string, std::function<void(
+    const ShortStrings &, std::vector<uint64_t> &)>>> LatencyRows;
+
+// Fixed costs first (the timer itself, an out of line call, reserve,
+// std_string_sink's initial resize), then every fix_utf8 overload; results
+// are freed within the timed call
+LatencyRows make_latency_rows()
+{
+    return LatencyRows {
+        {"timer   ", [](const ShortStrings &strings,
+                        std::vector<uint64_t> &lat) {
+            time_calls(strings, lat,
+                [](const unsigned char *i, const unsigned char *end) {});
+        }},
+        {"call    ", [](const ShortStrings &strings,
+                        std::vector<uint64_t> &lat) {
+            std::string res;
+            time_calls(strings, lat,
+                [&](const unsigned char *i, const unsigned char *end) {
+                    empty_call(res, i, end);
+                });
+        }},
+        {"reserve ", [](const ShortStrings &strings,
+                        std::vector<uint64_t> &lat) {
+            time_calls(strings, lat,
+                [](const unsigned char *i, const unsigned char *end) {
+                    std::string res;
+                    res.reserve(end - i);
+                });
+        }},
+        {"grow    ", [](const ShortStrings &strings,
+                        std::vector<uint64_t> &lat) {
+            time_calls(strings, lat,
+                [](const unsigned char *i, const unsigned char *end) {
+                    std::string res;
+                    res.reserve(end - i);
+                    res.resize(128);
+                });
+        }},
+        {"baseline", [](const ShortStrings &strings,
+                        std::vector<uint64_t> &lat) {
+            std::vector<unsigned char> buf(1024 * 3);
+            time_calls(strings, lat,
+                [&](const unsigned char *i, const unsigned char *end) {
+                    fix_utf8(&buf[0], i, end);
+                });
+        }},
+        {"malloc  ", [](const ShortStrings &strings,
+                        std::vector<uint64_t> &lat) {
+            void *p = 0;
+            time_calls(strings, lat,
+                [&](const unsigned char *i, const unsigned char *end) {
+                    free(p);
+                    fix_utf8(&p, i, end);
+                });
+            free(p);
+        }},
+        {"string  ", [](const ShortStrings &strings,
+                        std::vector<uint64_t> &lat) {
+            time_calls(strings, lat,
+                [](const unsigned char *i, const unsigned char *end) {
+                    std::string res;
+                    fix_utf8(res, i, end);
+                });
+        }},
+        {"vector  ", [](const ShortStrings &strings,
+                        std::vector<uint64_t> &lat) {
+            time_calls(strings, lat,
+                [](const unsigned char *i, const unsigned char *end) {
+                    std::vector<unsigned char> res;
+                    fix_utf8(res, i, end);
+                });
+        }},
+    };
+}
+
+// Percentiles of per call latency for short strings drawn from every
+// sample (timer overhead included, see the timer row)
+void run_latency(const Options &opts, const Samples &samples,
+                 std::vector<Record> &records)
+{
+    const LatencyRows rows = make_latency_rows();
+    const double tick = ns_per_tick();
+    std::vector<std::string> names;
+    for (auto &row: rows) {
+        names.push_back(row.first);
+    }
+
+    std::cout << std::fixed;
+    for (auto &sample: samples) {
+
+        ShortStrings strings = make_short_strings(sample, opts.strings);
+        size_t bytes = std::accumulate(
+            strings.size.begin(), strings.size.end(), (size_t)0);
+        std::vector<uint64_t> lat(opts.strings);
+        std::vector<std::vector<Result>> results;
+
+        for (auto &row: rows) {
+            row.second(strings, lat);   // warmup
+            row.second(strings, lat);
+            double sum = std::accumulate(lat.begin(), lat.end(), 0.0);
+            Result res;
+            res.bytes = bytes;
+            res.ns_per_call.add(sum * tick / lat.size());
+            res.gbps.add(bytes / (sum * tick));
+            auto percentile = [&](double q) {
+                auto nth = lat.begin() + (size_t)(q * (lat.size() - 1));
+                std::nth_element(lat.begin(), nth, lat.end());
+                return *nth * tick;
+            };
+            res.p50 = percentile(0.5);
+            res.p99 = percentile(0.99);
+            res.p999 = percentile(0.999);
+            results.push_back({res});
+            records.push_back(Record {
+                "latency " + plain_name(row.first), plain_name(sample.name),
+                bytes / lat.size(), res });
+        }
+
+        if (opts.format != Options::text)
+            continue;
+
+        print_table("latency " + sample.name + ", ns/call: p50 p99 p999 mean",
+            {"all"}, names, results, [](const Result &res) {
+                std::cout << std::setprecision(1) << res.p50 << " "
+                    << res.p99 << " " << res.p999 << " "
+                    << res.ns_per_call.mean;
+            });
+    }
+}
+
+// Build information comes from CMake
+#ifndef BENCH_GIT_REVISION
+#define BENCH_GIT_REVISION "unknown"
+#endif
+#ifndef BENCH_CXX_FLAGS
+#define BENCH_CXX_FLAGS "unknown"
+#endif
+
+std::string host_cpu()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0)
+            return line.substr(line.find(':') + 2);
+    }
+    return "unknown";
+}
+
+std::vector<std::pair<std::string, std::string>> host_info()
+{
+    return {
+        {"cpu", host_cpu()},
+#ifdef __VERSION__
+        {"compiler", __VERSION__},
+#endif
+        {"flags", BENCH_CXX_FLAGS},
+        {"revision", BENCH_GIT_REVISION},
+    };
+}
+
+std::string json_string(const std::string &s)
+{
+    std::string res = "\"";
+    for (char c: s) {
+        if (c == '"' || c == '\\')
+            res += '\\';
+        res += c;
+    }
+    return res + "\"";
+}
+
+// A CSV field, quoted if needed (RFC 4180)
+std::string csv_field(const std::string &s)
+{
+    if (s.find_first_of(",\"\r\n") == std::string::npos)
+        return s;
+    std::string res = "\"";
+    for (char c: s) {
+        if (c == '"')
+            res += '"';
+        res += c;
+    }
+    return res + "\"";
+}
+
+// Host information in comments, one row per result (bench_compare reads
+// these)
+void write_csv(const std::vector<Record> &records)
+{
+    for (auto &info: host_info()) {
+        std::cout << "# " << info.first << ": " << info.second << std::endl;
+    }
+    std::cout << "contestant,sample,size,reps,gbps_mean,gbps_sd,"
+        "cpb_mean,cpb_sd,ns_per_call_mean,ns_per_call_sd";
+    for (int k = 0; k < PerfCounters::count; k++) {
+        std::cout << "," << PerfCounters::name(k) << "_per_byte";
+    }
+    std::cout << ",mallocs_per_call,reallocs_per_call,frees_per_call,"
+        "alloc_bytes_per_call,peak_heap,over_allocation,peak_rss,"
+        "latency_p50,latency_p99,latency_p999";
+    std::cout << std::endl;
+    std::cout << std::setprecision(6) << std::defaultfloat;
+    for (auto &rec: records) {
+        const Result &res = rec.res;
+        std::cout << csv_field(rec.contestant) << ","
+            << csv_field(rec.sample) << "," << rec.size
+            << "," << res.gbps.n << "," << res.gbps.mean << ","
+            << res.gbps.sd() << "," << res.cpb.mean << "," << res.cpb.sd()
+            << "," << res.ns_per_call.mean << "," << res.ns_per_call.sd();
+        for (int k = 0; k < PerfCounters::count; k++) {
+            std::cout << ",";
+            if (perf_counters.available(k))
+                std::cout << res.counters[k].mean;
+        }
+        for (int k = 0; k < AllocCounters::count; k++) {
+            std::cout << ",";
+            if (alloc_accounting)
+                std::cout << res.allocs[k].mean;
+        }
+        if (alloc_accounting)
+            std::cout << "," << res.peak_heap.mean << "," << res.slack.mean
+                << "," << res.rss;
+        else
+            std::cout << ",,,";
+        if (res.p50)
+            std::cout << "," << res.p50 << "," << res.p99 << "," << res.p999;
+        else
+            std::cout << ",,,";
         std::cout << std::endl;
+    }
+}
 
+void write_json(const std::vector<Record> &records)
+{
+    std::cout << "{\n  \"host\": {";
+    const char *sep = "\n";
+    for (auto &info: host_info()) {
+        std::cout << sep << "    " << json_string(info.first) << ": "
+            << json_string(info.second);
+        sep = ",\n";
     }
+    std::cout << "\n  },\n  \"results\": [";
+    std::cout << std::setprecision(6) << std::defaultfloat;
+    sep = "\n";
+    for (auto &rec: records) {
+        const Result &res = rec.res;
+        std::cout << sep << "    {\"contestant\": "
+            << json_string(rec.contestant)
+            << ", \"sample\": " << json_string(rec.sample)
+            << ", \"size\": " << rec.size
+            << ", \"reps\": " << res.gbps.n
+            << ", \"gbps_mean\": " << res.gbps.mean
+            << ", \"gbps_sd\": " << res.gbps.sd()
+            << ", \"cpb_mean\": " << res.cpb.mean
+            << ", \"cpb_sd\": " << res.cpb.sd()
+            << ", \"ns_per_call_mean\": " << res.ns_per_call.mean
+            << ", \"ns_per_call_sd\": " << res.ns_per_call.sd();
+        for (int k = 0; k < PerfCounters::count; k++) {
+            if (perf_counters.available(k))
+                std::cout << ", \"" << PerfCounters::name(k)
+                    << "_per_byte\": " << res.counters[k].mean;
+        }
+        if (alloc_accounting) {
+            std::cout << ", \"mallocs_per_call\": "
+                << res.allocs[AllocCounters::mallocs].mean
+                << ", \"reallocs_per_call\": "
+                << res.allocs[AllocCounters::reallocs].mean
+                << ", \"frees_per_call\": "
+                << res.allocs[AllocCounters::frees].mean
+                << ", \"alloc_bytes_per_call\": "
+                << res.allocs[AllocCounters::bytes].mean
+                << ", \"peak_heap\": " << res.peak_heap.mean
+                << ", \"over_allocation\": " << res.slack.mean
+                << ", \"peak_rss\": " << res.rss;
+        }
+        if (res.p50) {
+            std::cout << ", \"latency_p50\": " << res.p50
+                << ", \"latency_p99\": " << res.p99
+                << ", \"latency_p999\": " << res.p999;
+        }
+        std::cout << "}";
+        sep = ",\n";
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    Options opts = parse_options(argc, argv);
+    const std::vector<int> cpus = allowed_cpus();
+    pin_cpu(opts.cpu);
+    alloc_accounting = opts.alloc;
+
+    sanity_check();
+
+    const Samples samples = make_samples(opts);
+    const Contestants contestants = make_contestants();
+
+    std::vector<Record> records;
+    if (opts.sweep)
+        run_sweep(opts, samples, contestants, records);
+    else if (opts.threads)
+        run_threads(opts, samples, contestants, cpus, records);
+    else if (opts.latency)
+        run_latency(opts, samples, records);
+    else
+        run_table(opts, samples, contestants, records);
+
+    if (opts.format == Options::csv)
+        write_csv(records);
+    else if (opts.format == Options::json)
+        write_json(records);
 
     return 0;
 }
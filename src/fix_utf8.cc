@@ -1,6 +1,15 @@
 #include "fix_utf8.h"
+#include "fix_utf8_tables.h"
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+#if __x86_64__
+#include <nmmintrin.h>
+#endif
 
 // Make navigating generated assembly manageable (for dummies like me).
 // Ensure it doesn't change the generated code except for comments,
@@ -16,13 +25,79 @@ namespace {
 // UTF-8 continuation byte?
 inline bool utf8_contb(unsigned char c) { return (c & 0xc0) == 0x80; }
 
+#if __SSE2__
+// SSE2 helpers for byte classes (signed compares, ASCII arguments only)
+inline __m128i simd_eq(__m128i v, char c)
+{
+    return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+inline __m128i simd_in(__m128i v, char lo, char hi)
+{
+    return _mm_and_si128(
+        _mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+        _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+// bytes below 0x20 or above 0x7f (the latter are negative)
+inline __m128i simd_ctl_or_high(__m128i v)
+{
+    return _mm_cmplt_epi8(v, _mm_set1_epi8(0x20));
+}
+#endif
+
+// Bytes are copied as is by default
+struct identity_map
+{
+    static unsigned char map(unsigned char c) { return c; }
+#if __SSE2__
+    static __m128i map(__m128i v) { return v; }
+#endif
+};
+
+// Copy the run of bytes in [i, end) ByteClass doesn't consider special
+// to out, return the end of the run. ByteClass::special has a scalar and
+// an SSE2 overload, the latter sets the high bit of every special byte in
+// a vector. Whole vectors are stored before looking at the mask (runs are
+// often short), hence out must have room for end - i bytes. Bytes are
+// transformed with Map::map on the way.
+template <typename ByteClass, typename Map = identity_map>
+inline const unsigned char *
+copy_plain(unsigned char *&pout,
+           const unsigned char *i, const unsigned char *end)
+{
+    // a local, stores through unsigned char * alias the reference
+    unsigned char *out = pout;
+#if __SSE2__
+    while (end - i >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(i));
+        unsigned mask = _mm_movemask_epi8(ByteClass::special(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), Map::map(v));
+        if (mask) {
+            unsigned n = __builtin_ctz(mask);
+            pout = out + n;
+            return i + n;
+        }
+        out += 16;
+        i += 16;
+    }
+#endif
+    while (i < end && !ByteClass::special(*i))
+        *out++ = Map::map(*i++);
+    pout = out;
+    return i;
+}
+
 // Templated Sink allows us to play with different methods for building
 // the output to estimate the relative efficiency of various approaches
 // (ex: a large buffer with no bounds checking vs. std::string).
 //
 // The handling of invalid bytes is also configurable via the sink.
+//
+// A sink may process runs of ASCII bytes in bulk (Sink::bulk). The engine
+// lets it consume the run of bytes it can handle on its own, typically
+// copying them verbatim (copy_run returns the end of the run). Bytes not
+// in a run are fed to write<1> one by one as usual.
 template <typename Sink>
-__attribute__((__always_inline__))
+__attribute__((__always_inline__)) inline
 const unsigned char *
 fix_utf8_engine(Sink &sink,
                 const unsigned char *i, const unsigned char *end)
@@ -42,6 +117,13 @@ fix_utf8_engine(Sink &sink,
 
             case 0x00 ... 0x7f:
                 ASM_COMMENT("1-byte");
+                if (Sink::bulk) {
+                    const unsigned char *run = sink.copy_run(i, end);
+                    if (run != i) {
+                        i = run;
+                        continue;
+                    }
+                }
                 // 1-byte UTF-8 sequence
                 // make output
                 sink.template write<1>(i);
@@ -146,10 +228,18 @@ inline unsigned char utf8b_3(unsigned char c) { return 0x80 | (c & 0x3f); }
 // probably the fastest option
 struct big_buf_sink
 {
+    enum { bulk = 0 };
     unsigned char *p_;
     big_buf_sink(void *p): p_(static_cast<unsigned char *>(p)) {}
     bool check_capacity() { return true; }
     template<size_t n> void write(const unsigned char *p);
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) { return i; }
+    // output a literal (ex: an entity)
+    void put(const char *s, size_t n) {
+        memcpy(p_, s, n);
+        p_ += n;
+    }
     void write_bad(const unsigned char *p) {
         unsigned char c = p[0];
         p_[0] = utf8b_1(c);
@@ -217,29 +307,396 @@ struct std_string_sink: big_buf_sink
     }
     bool check_capacity()
     {
-        if (__builtin_expect(p_ + 6 >= end_, 0)) {
-            grow(cur_off());
-        }
+        reserve(6);
         return true;
     }
+    // ensure more than n bytes are available
+    void reserve(size_t n)
+    {
+        if (__builtin_expect(p_ + n >= end_, 0)) {
+            grow(cur_off(), n);
+        }
+    }
+    // copy_run helpers: the end of a run starting at i bounded to keep
+    // reserve reasonable, room for it is reserved
+    const unsigned char *bounded_run(const unsigned char *i,
+                                     const unsigned char *end)
+    {
+        if (end - i > 4096)
+            end = i + 4096;
+        reserve(end - i);
+        return end;
+    }
+    template <typename ByteClass, typename Map = identity_map>
+    const unsigned char *plain_run(const unsigned char *i,
+                                   const unsigned char *end)
+    {
+        return copy_plain<ByteClass, Map>(p_, i, bounded_run(i, end));
+    }
+    unsigned char *begin() { return (unsigned char *)&s_[0]; }
     size_t cur_off() const { return p_ - (unsigned char *)&s_[0]; }
-    void grow(size_t cur_off)
+    void grow(size_t cur_off, size_t n = 0)
     {
-        s_.resize(s_.size() + 128);
+        s_.resize(s_.size() + 128 + n);
         p_ = (unsigned char *)&s_[0] + cur_off;
         end_ = (unsigned char *)&s_[0] + s_.size();
     }
 };
 
+// Write output to a fixed size buffer, stop at the first output sequence
+// that doesn't fit. Also remembers the last cut leaving room for an
+// ellipsis of the given length.
+struct truncating_sink: big_buf_sink
+{
+    unsigned char *end_, *mark_end_, *mark_;
+    const unsigned char *mark_in_;  // input consumed at mark_
+    const unsigned char *stop_;     // input that didn't fit (or 0)
+    truncating_sink(void *p, size_t size, size_t reserved,
+                    const unsigned char *i):
+        big_buf_sink(p), end_(p_ + size), mark_end_(end_ - reserved),
+        mark_(p_), mark_in_(i), stop_(0) {}
+    bool check_capacity() { return !stop_; }
+    template<size_t n> void write(const unsigned char *p) {
+        if (!fits(p, n))
+            return;
+        big_buf_sink::write<n>(p);
+        update_mark(p + n);
+    }
+    void write_bad(const unsigned char *p) {
+        if (!fits(p, 3))
+            return;
+        big_buf_sink::write_bad(p);
+        update_mark(p + 1);
+    }
+    bool fits(const unsigned char *p, size_t n) {
+        if (__builtin_expect(p_ + n > end_ && !stop_, 0))
+            stop_ = p;
+        return !stop_;
+    }
+    void update_mark(const unsigned char *in) {
+        if (p_ <= mark_end_) {
+            mark_ = p_;
+            mark_in_ = in;
+        }
+    }
+};
+
+// Code point of a valid n-byte UTF-8 sequence
+template<size_t n> unsigned long utf8_decode(const unsigned char *p);
+template<> unsigned long utf8_decode<1>(const unsigned char *p) {
+    return p[0];
+}
+template<> unsigned long utf8_decode<2>(const unsigned char *p) {
+    return (p[0] & 0x1f) << 6 | (p[1] & 0x3f);
+}
+template<> unsigned long utf8_decode<3>(const unsigned char *p) {
+    return (p[0] & 0x0f) << 12 | (p[1] & 0x3f) << 6 | (p[2] & 0x3f);
+}
+template<> unsigned long utf8_decode<4>(const unsigned char *p) {
+    return (unsigned long)(p[0] & 0x07) << 18 | (p[1] & 0x3f) << 12 |
+        (p[2] & 0x3f) << 6 | (p[3] & 0x3f);
+}
+
+// Terminal column width of a code point
+inline unsigned display_width(unsigned long cp)
+{
+    unsigned char b = width_blocks[width_index[cp >> 8]][(cp & 0xff) >> 2];
+    return (b >> ((cp & 3) * 2)) & 3;
+}
+
+// Add statistics (see fix_utf8_stats) to any sink, the counting is done
+// in write<n> where the sequence length is known.
+template <typename Base>
+struct stats_sink: Base
+{
+    // the counting is done per sequence
+    enum { bulk = 0 };
+    size_t code_points_ = 0, width_ = 0;
+    using Base::Base;
+    template<size_t n> void write(const unsigned char *p) {
+        code_points_++;
+        width_ += display_width(utf8_decode<n>(p));
+        Base::template write<n>(p);
+    }
+    void write_bad(const unsigned char *p) {
+        // displayed as a replacement character
+        code_points_++;
+        width_++;
+        Base::write_bad(p);
+    }
+};
+
+// XXH64, the state is updated in 32 byte stripes
+struct xxh64
+{
+    static const uint64_t p1 = 0x9e3779b185ebca87ULL;
+    static const uint64_t p2 = 0xc2b2ae3d27d4eb4fULL;
+    static const uint64_t p3 = 0x165667b19e3779f9ULL;
+    static const uint64_t p4 = 0x85ebca77c2b2ae63ULL;
+    static const uint64_t p5 = 0x27d4eb2f165667c5ULL;
+    uint64_t seed_, v1_, v2_, v3_, v4_;
+    xxh64(uint64_t seed):
+        seed_(seed), v1_(seed + p1 + p2), v2_(seed + p2), v3_(seed),
+        v4_(seed - p1) {}
+    static uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+    static uint64_t read64(const unsigned char *p) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+    }
+    static uint32_t read32(const unsigned char *p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+    static uint64_t round(uint64_t acc, uint64_t input) {
+        return rotl(acc + input * p2, 31) * p1;
+    }
+    static uint64_t merge(uint64_t acc, uint64_t v) {
+        return (acc ^ round(0, v)) * p1 + p4;
+    }
+    void stripe(const unsigned char *p) {
+        v1_ = round(v1_, read64(p));
+        v2_ = round(v2_, read64(p + 8));
+        v3_ = round(v3_, read64(p + 16));
+        v4_ = round(v4_, read64(p + 24));
+    }
+    // size - the total length, tail - the last size % 32 bytes
+    uint64_t finish(const unsigned char *tail, uint64_t size) const {
+        uint64_t h;
+        if (size >= 32) {
+            h = rotl(v1_, 1) + rotl(v2_, 7) + rotl(v3_, 12) + rotl(v4_, 18);
+            h = merge(merge(merge(merge(h, v1_), v2_), v3_), v4_);
+        } else {
+            h = seed_ + p5;
+        }
+        h += size;
+        size_t n = size % 32;
+        for (; n >= 8; n -= 8, tail += 8)
+            h = rotl(h ^ round(0, read64(tail)), 27) * p1 + p4;
+        if (n >= 4) {
+            h = rotl(h ^ (read32(tail) * p1), 23) * p2 + p3;
+            n -= 4;
+            tail += 4;
+        }
+        for (; n; n--, tail++)
+            h = rotl(h ^ (*tail * p5), 11) * p1;
+        h ^= h >> 33;
+        h *= p2;
+        h ^= h >> 29;
+        h *= p3;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
+// Hash the output as it is produced: whenever a stripe is complete it is
+// hashed while still in L1 (Base is std_string_sink or alike).
+template <typename Base>
+struct hash_sink: Base
+{
+    xxh64 hash_;
+    size_t begin_off_, hashed_off_;
+    hash_sink(std::string &s, uint64_t seed):
+        Base(s), hash_(seed), begin_off_(Base::cur_off()),
+        hashed_off_(begin_off_) {}
+    bool check_capacity() {
+        if (__builtin_expect(Base::cur_off() - hashed_off_ >= 32, 0))
+            hash_stripes();
+        return Base::check_capacity();
+    }
+    void hash_stripes() {
+        const unsigned char *begin = Base::begin();
+        size_t off = hashed_off_, cur_off = Base::cur_off();
+        for (; cur_off - off >= 32; off += 32)
+            hash_.stripe(begin + off);
+        hashed_off_ = off;
+    }
+    uint64_t finish() {
+        hash_stripes();
+        return hash_.finish(Base::begin() + hashed_off_,
+                            Base::cur_off() - begin_off_);
+    }
+};
+
+// CRC32C (Castagnoli), operating on the non-inverted state.
+// Table based, slicing by 8 bytes.
+struct crc32c_table
+{
+    uint32_t t_[8][256];
+    crc32c_table() {
+        for (unsigned n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+            t_[0][n] = c;
+        }
+        for (unsigned n = 0; n < 256; n++)
+            for (int k = 1; k < 8; k++)
+                t_[k][n] = (t_[k-1][n] >> 8) ^ t_[0][t_[k-1][n] & 0xff];
+    }
+    static const crc32c_table &get() {
+        static const crc32c_table table;
+        return table;
+    }
+    static uint32_t update(uint32_t crc, const unsigned char *p, size_t n) {
+        const uint32_t (*t)[256] = get().t_;
+        for (; n >= 8; n -= 8, p += 8) {
+            uint32_t a, b;
+            memcpy(&a, p, 4);
+            memcpy(&b, p + 4, 4);
+            a ^= crc;
+            crc = t[7][a & 0xff] ^ t[6][(a >> 8) & 0xff] ^
+                t[5][(a >> 16) & 0xff] ^ t[4][a >> 24] ^
+                t[3][b & 0xff] ^ t[2][(b >> 8) & 0xff] ^
+                t[1][(b >> 16) & 0xff] ^ t[0][b >> 24];
+        }
+        for (; n; n--, p++)
+            crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+        return crc;
+    }
+};
+
+#if __x86_64__
+// SSE4.2 crc32 instruction (the caller checks the CPU). Not inlined: the
+// rest of the code isn't compiled for SSE4.2, and it's called once per
+// 64+ bytes anyway.
+__attribute__((__target__("sse4.2"), __noinline__))
+uint32_t crc32c_sse42_update(uint32_t crc, const unsigned char *p, size_t n)
+{
+    uint64_t c = crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    for (; n; n--, p++)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+
+struct crc32c_sse42
+{
+    static uint32_t update(uint32_t crc, const unsigned char *p, size_t n) {
+        return crc32c_sse42_update(crc, p, n);
+    }
+};
+#endif
+
+// CRC32C of the consumed input and the output, updated in the engine loop
+// once enough bytes accumulated (Base is std_string_sink or alike).
+template <typename Base, typename Crc>
+struct crc_sink: Base
+{
+    uint32_t in_crc_, out_crc_;
+    const unsigned char *in_, *in_done_;
+    size_t out_done_;
+    crc_sink(std::string &s, const unsigned char *i):
+        Base(s), in_crc_(~0u), out_crc_(~0u), in_(i), in_done_(i),
+        out_done_(Base::cur_off()) {}
+    bool check_capacity() {
+        if (__builtin_expect(in_ - in_done_ >= 64, 0)) {
+            size_t n = (in_ - in_done_) & ~size_t(7);
+            in_crc_ = Crc::update(in_crc_, in_done_, n);
+            in_done_ += n;
+        }
+        if (__builtin_expect(Base::cur_off() - out_done_ >= 64, 0)) {
+            size_t n = (Base::cur_off() - out_done_) & ~size_t(7);
+            out_crc_ = Crc::update(out_crc_, Base::begin() + out_done_, n);
+            out_done_ += n;
+        }
+        return Base::check_capacity();
+    }
+    template<size_t n> void write(const unsigned char *p) {
+        Base::template write<n>(p);
+        in_ = p + n;
+    }
+    void write_bad(const unsigned char *p) {
+        Base::write_bad(p);
+        in_ = p + 1;
+    }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+        return in_ = Base::copy_run(i, end);
+    }
+    // input consumed up to end
+    void finish(const unsigned char *end) {
+        in_crc_ = Crc::update(in_crc_, in_done_, end - in_done_);
+        out_crc_ = Crc::update(out_crc_, Base::begin() + out_done_,
+                               Base::cur_off() - out_done_);
+    }
+};
+
+template <typename Crc>
+void fix_utf8_crc_impl(std::string &result,
+                       const unsigned char *i, const unsigned char *end,
+                       fix_utf8_crc &crc)
+{
+    result.reserve(result.size() + (end - i));
+    crc_sink<std_string_sink, Crc> sink(result, i);
+    fix_utf8_engine(sink, i, end);
+    sink.finish(end);
+    result.resize(sink.cur_off());
+    crc.input = ~sink.in_crc_;
+    crc.output = ~sink.out_crc_;
+}
+
+// Count invalid bytes on top of any sink
+template <typename Base>
+struct invalid_count_sink: Base
+{
+    size_t invalid_ = 0;
+    using Base::Base;
+    void write_bad(const unsigned char *p) {
+        invalid_++;
+        Base::write_bad(p);
+    }
+};
+
+// End of a block of input starting at i; the block is shortened so that
+// no sequence crosses the boundary: processing blocks one by one gives
+// the same result as processing the whole input.
+//
+// The engine starts a new step at every byte that isn't a continuation
+// byte, and a step never takes more continuation bytes than its lead byte
+// calls for. Hence b is a boundary unless a lead byte less than 4 bytes
+// before it calls for a sequence reaching past it; the block then ends
+// before that lead byte. size must be at least 4 (a sequence's length),
+// so that such a lead byte is never the first byte of the block.
+inline const unsigned char *
+block_end(const unsigned char *i, const unsigned char *end, size_t size)
+{
+    if ((size_t)(end - i) <= size)
+        return end;
+    const unsigned char *b = i + size;
+    if (!utf8_contb(*b))
+        return b;
+    for (const unsigned char *lead = b - 1; lead > b - 4; lead--) {
+        if (utf8_contb(*lead))
+            continue;
+        size_t len = *lead >= 0xf0 ? 4 : *lead >= 0xe0 ? 3 :
+            *lead >= 0xc0 ? 2 : 1;
+        return lead + len <= b ? b : lead;
+    }
+    // a stray continuation byte
+    return b;
+}
+
 // Write output to std::vector
 struct std_vector_sink
 {
+    enum { bulk = 0 };
     std::vector<unsigned char> &v_;
     std_vector_sink(std::vector<unsigned char> &v): v_(v) {}
     bool check_capacity() { return true; }
     template<size_t n> void write(const unsigned char *p) {
         v_.insert(v_.end(), p, p+n);
     }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) { return i; }
     void write_bad(const unsigned char *p) {
         unsigned char esc[] = {
             utf8b_1(*p),
@@ -250,6 +707,841 @@ struct std_vector_sink
     }
 };
 
+// Characters needing attention in XML 1.0 output: controls, non-ASCII
+// and markup
+struct xml_class
+{
+    static bool special(unsigned char c) {
+        return c < 0x20 || c > 0x7f ||
+            c == '<' || c == '>' || c == '&' || c == '"' || c == '\'';
+    }
+#if __SSE2__
+    static __m128i special(__m128i v) {
+        __m128i markup = _mm_or_si128(
+            _mm_or_si128(simd_eq(v, '<'), simd_eq(v, '>')),
+            _mm_or_si128(simd_eq(v, '&'),
+                _mm_or_si128(simd_eq(v, '"'), simd_eq(v, '\''))));
+        return _mm_or_si128(simd_ctl_or_high(v), markup);
+    }
+#endif
+};
+
+// XML 1.0 output, the largest thing we emit is an entity (6 bytes)
+// which fits in std_string_sink reserve
+struct xml_sink: std_string_sink
+{
+    enum { bulk = 1 };
+    bool drop_;
+    xml_sink(std::string &s, bool drop): std_string_sink(s), drop_(drop) {}
+    template<size_t n> void write(const unsigned char *p) {
+        big_buf_sink::write<n>(p);
+    }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+        return plain_run<xml_class>(i, end);
+    }
+    void write_bad(const unsigned char *p) { write_invalid(); }
+    // a character not allowed in XML
+    void write_invalid() {
+        if (!drop_)
+            put("\xef\xbf\xbd", 3); // U+FFFD
+    }
+};
+template<> void xml_sink::write<1>(const unsigned char *p) {
+    switch (p[0]) {
+        case '<': put("&lt;", 4); return;
+        case '>': put("&gt;", 4); return;
+        case '&': put("&amp;", 5); return;
+        case '"': put("&quot;", 6); return;
+        case '\'': put("&apos;", 6); return;
+        case '\t': case '\n': case '\r': break;
+        case 0x00 ... 0x08:
+        case 0x0b ... 0x0c:
+        case 0x0e ... 0x1f: write_invalid(); return;
+    }
+    big_buf_sink::write<1>(p);
+}
+template<> void xml_sink::write<3>(const unsigned char *p) {
+    // U+FFFE, U+FFFF
+    if (__builtin_expect(p[0] == 0xef && p[1] == 0xbf && p[2] >= 0xbe, 0))
+        return write_invalid();
+    big_buf_sink::write<3>(p);
+}
+
+// RFC 3986 unreserved characters
+constexpr bool url_unreserved(unsigned c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+        c == '~';
+}
+
+// Percent-encoding classes of ASCII bytes:
+// 0 - unreserved, 1 - reserved (encoded with pct_reserved), 2 - space
+// (encoded unless pct_keep_space), 3 - controls and "%" (always encoded,
+// a literal "%" would be mistaken for an escape)
+enum { url_unreserved_c, url_reserved_c, url_space_c, url_ctl_c };
+#define URL_CLASS(c) \
+    (url_unreserved(c) ? url_unreserved_c : \
+     (c) == ' ' ? url_space_c : \
+     (c) < 0x20 || (c) == 0x7f || (c) == '%' ? url_ctl_c : url_reserved_c)
+#define URL_CLASS4(c) \
+    URL_CLASS(c), URL_CLASS(c+1), URL_CLASS(c+2), URL_CLASS(c+3)
+#define URL_CLASS16(c) \
+    URL_CLASS4(c), URL_CLASS4(c+4), URL_CLASS4(c+8), URL_CLASS4(c+12)
+constexpr unsigned char url_class[128] = {
+    URL_CLASS16(0x00), URL_CLASS16(0x10), URL_CLASS16(0x20),
+    URL_CLASS16(0x30), URL_CLASS16(0x40), URL_CLASS16(0x50),
+    URL_CLASS16(0x60), URL_CLASS16(0x70)
+};
+#undef URL_CLASS16
+#undef URL_CLASS4
+#undef URL_CLASS
+static_assert(url_class[' '] == url_space_c, "url_class");
+static_assert(url_class['%'] == url_ctl_c, "url_class");
+static_assert(url_class['~'] == url_unreserved_c, "url_class");
+static_assert(url_class[0x7f] == url_ctl_c, "url_class");
+
+// Bytes percent-encoding never keeps as is: controls, "%", non-ASCII,
+// and space unless KeepSpace
+template <bool KeepSpace>
+struct url_ctl_class
+{
+    static bool special(unsigned char c) {
+        return c < 0x20 || c > 0x7e || c == '%' || (!KeepSpace && c == ' ');
+    }
+#if __SSE2__
+    static __m128i special(__m128i v) {
+        __m128i res = _mm_or_si128(
+            _mm_or_si128(simd_ctl_or_high(v), simd_eq(v, 0x7f)),
+            simd_eq(v, '%'));
+        return KeepSpace ? res : _mm_or_si128(res, simd_eq(v, ' '));
+    }
+#endif
+};
+
+// Bytes other than unreserved characters
+struct url_reserved_class
+{
+    static bool special(unsigned char c) {
+        return c > 0x7f || url_class[c] != url_unreserved_c;
+    }
+#if __SSE2__
+    static __m128i special(__m128i v) {
+        __m128i plain = _mm_or_si128(
+            _mm_or_si128(simd_in(v, 'a', 'z'), simd_in(v, 'A', 'Z')),
+            _mm_or_si128(simd_in(v, '0', '9'),
+                _mm_or_si128(
+                    _mm_or_si128(simd_eq(v, '-'), simd_eq(v, '.')),
+                    _mm_or_si128(simd_eq(v, '_'), simd_eq(v, '~')))));
+        return _mm_xor_si128(plain, _mm_set1_epi8(-1));
+    }
+#endif
+};
+
+// Percent-encoded output (see fix_utf8_percent), up to 12 bytes for
+// an encoded 4-byte sequence
+struct percent_sink: std_string_sink
+{
+    enum { bulk = 1 };
+    unsigned flags_;
+    unsigned char min_class_;
+    percent_sink(std::string &s, unsigned flags):
+        std_string_sink(s), flags_(flags),
+        min_class_(flags & pct_reserved ? url_reserved_c :
+                   flags & pct_keep_space ? url_ctl_c : url_space_c) {}
+    bool check_capacity()
+    {
+        reserve(12);
+        return true;
+    }
+    template<size_t n> void write(const unsigned char *p) {
+        if (flags_ & pct_non_ascii) {
+            for (size_t k = 0; k < n; k++)
+                encode(p[k]);
+        } else {
+            big_buf_sink::write<n>(p);
+        }
+    }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+        if (flags_ & pct_reserved)
+            return plain_run<url_reserved_class>(i, end);
+        if (flags_ & pct_keep_space)
+            return plain_run<url_ctl_class<true> >(i, end);
+        return plain_run<url_ctl_class<false> >(i, end);
+    }
+    void write_bad(const unsigned char *p) { encode(p[0]); }
+    void encode(unsigned char c) {
+        static const char hex[] = "0123456789ABCDEF";
+        p_[0] = '%';
+        p_[1] = hex[c >> 4];
+        p_[2] = hex[c & 0xf];
+        p_ += 3;
+    }
+};
+template<> void percent_sink::write<1>(const unsigned char *p) {
+    if (url_class[p[0]] >= min_class_)
+        encode(p[0]);
+    else
+        big_buf_sink::write<1>(p);
+}
+
+// Bytes needing attention in terminal log output: controls other than
+// TAB and LF, DEL and non-ASCII
+struct ctl_class
+{
+    static bool special(unsigned char c) {
+        return (c < 0x20 && c != '\t' && c != '\n') || c > 0x7e;
+    }
+#if __SSE2__
+    static __m128i special(__m128i v) {
+        __m128i ctl = _mm_or_si128(simd_ctl_or_high(v), simd_eq(v, 0x7f));
+        return _mm_andnot_si128(
+            _mm_or_si128(simd_eq(v, '\t'), simd_eq(v, '\n')), ctl);
+    }
+#endif
+};
+
+// What terminal log output does with an ASCII byte:
+// 0 - drop, 1 - keep, 2 - slow path (escape or ESC when stripping CSI).
+// Dropping and keeping is branchless, since controls are frequent in
+// some inputs.
+#define CTL_ACTION(c, ctl, esc) \
+    ((c) == 0x1b ? (esc) : \
+     ((c) < 0x20 && (c) != '\t' && (c) != '\n') || (c) == 0x7f ? (ctl) : 1)
+#define CTL_ACTION4(c, ctl, esc) \
+    CTL_ACTION(c, ctl, esc), CTL_ACTION(c+1, ctl, esc), \
+    CTL_ACTION(c+2, ctl, esc), CTL_ACTION(c+3, ctl, esc)
+#define CTL_ACTION16(c, ctl, esc) \
+    CTL_ACTION4(c, ctl, esc), CTL_ACTION4(c+4, ctl, esc), \
+    CTL_ACTION4(c+8, ctl, esc), CTL_ACTION4(c+12, ctl, esc)
+#define CTL_ACTIONS(ctl, esc) { \
+    CTL_ACTION16(0x00, ctl, esc), CTL_ACTION16(0x10, ctl, esc), \
+    CTL_ACTION16(0x20, ctl, esc), CTL_ACTION16(0x30, ctl, esc), \
+    CTL_ACTION16(0x40, ctl, esc), CTL_ACTION16(0x50, ctl, esc), \
+    CTL_ACTION16(0x60, ctl, esc), CTL_ACTION16(0x70, ctl, esc) }
+const unsigned char ctl_actions[3][128] = {
+    CTL_ACTIONS(0, 0),  // drop
+    CTL_ACTIONS(0, 2),  // drop, strip CSI
+    CTL_ACTIONS(2, 2)   // escape
+};
+#undef CTL_ACTIONS
+#undef CTL_ACTION16
+#undef CTL_ACTION4
+#undef CTL_ACTION
+
+// Terminal log output (see fix_utf8_ctl). Tracks ANSI escape sequences
+// when stripping CSI; a pending ESC costs 4 bytes on top of a C1 escape
+// (6 bytes).
+struct ctl_sink: std_string_sink
+{
+    enum { bulk = 1 };
+    enum { ground, esc, csi };
+    unsigned flags_;
+    int state_;
+    const unsigned char *actions_;
+    ctl_sink(std::string &s, unsigned flags):
+        std_string_sink(s), flags_(flags), state_(ground),
+        actions_(ctl_actions[flags & ctl_escape ? 2 :
+                             flags & ctl_strip_csi ? 1 : 0]) {}
+    bool check_capacity()
+    {
+        reserve(10);
+        return true;
+    }
+    template<size_t n> void write(const unsigned char *p) {
+        if (__builtin_expect(state_ != ground, 0))
+            abort_sequence();
+        big_buf_sink::write<n>(p);
+    }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+        // Controls are dropped here as well: they are frequent in some
+        // inputs and going through the engine for each is expensive.
+        if (state_ != ground)
+            return i;
+        end = bounded_run(i, end);
+        for (;;) {
+            i = copy_plain<ctl_class>(p_, i, end);
+            // drop the control unless it takes the slow path
+            if (i == end || *i > 0x7f || actions_[*i] != 0)
+                return i;
+            i++;
+        }
+    }
+    void write_bad(const unsigned char *p) {
+        if (__builtin_expect(state_ != ground, 0))
+            abort_sequence();
+        big_buf_sink::write_bad(p);
+    }
+    // control character code
+    void write_ctl(unsigned c) {
+        static const char hex[] = "0123456789abcdef";
+        if (!(flags_ & ctl_escape))
+            return;
+        if (c < 0x80) {
+            put("\\x", 2);
+        } else {
+            put("\\u00", 4);
+        }
+        p_[0] = hex[c >> 4];
+        p_[1] = hex[c & 0xf];
+        p_ += 2;
+    }
+    // a sequence was interrupted by something else; a pending ESC is
+    // a control on its own, an incomplete CSI is dropped
+    void abort_sequence() {
+        if (state_ == esc)
+            write_ctl(0x1b);
+        state_ = ground;
+    }
+    void finish() {
+        reserve(6);
+        abort_sequence();
+    }
+};
+template<> void ctl_sink::write<1>(const unsigned char *p) {
+    unsigned char c = p[0];
+    unsigned action = actions_[c];
+    if (__builtin_expect(action < 2 && state_ == ground, 1)) {
+        p_[0] = c;
+        p_ += action;
+        return;
+    }
+    if (state_ != ground) {
+        if (state_ == esc && c == '[') {
+            state_ = csi;
+            return;
+        }
+        if (state_ == csi && c >= 0x20 && c <= 0x7e) {
+            // parameter and intermediate bytes, then the final byte
+            if (c >= 0x40)
+                state_ = ground;
+            return;
+        }
+        abort_sequence();
+    }
+    switch (c) {
+        case 0x1b:
+            if (flags_ & ctl_strip_csi) {
+                state_ = esc;
+                return;
+            }
+            // fallthrough
+        case 0x00 ... 0x08:
+        case 0x0b ... 0x1a:
+        case 0x1c ... 0x1f:
+        case 0x7f:
+            return write_ctl(c);
+    }
+    big_buf_sink::write<1>(p);
+}
+template<> void ctl_sink::write<2>(const unsigned char *p) {
+    if (__builtin_expect(state_ != ground, 0))
+        abort_sequence();
+    // C1 controls U+0080..U+009F
+    if (p[0] == 0xc2 && p[1] <= 0x9f) {
+        if (p[1] == 0x9b && (flags_ & ctl_strip_csi)) {
+            state_ = csi;
+            return;
+        }
+        return write_ctl(p[1]);
+    }
+    big_buf_sink::write<2>(p);
+}
+
+// Non-ASCII bytes
+struct non_ascii_class
+{
+    static bool special(unsigned char c) { return c > 0x7f; }
+#if __SSE2__
+    static __m128i special(__m128i v) { return v; }
+#endif
+};
+
+// ASCII lowercase
+struct ascii_lower_map
+{
+    static unsigned char map(unsigned char c) {
+        return c + ((unsigned char)(c - 'A') < 26 ? 0x20 : 0);
+    }
+#if __SSE2__
+    static __m128i map(__m128i v) {
+        return _mm_add_epi8(
+            v, _mm_and_si128(simd_in(v, 'A', 'Z'), _mm_set1_epi8(0x20)));
+    }
+#endif
+};
+
+// Lowercased output (see fix_utf8_lower)
+struct lower_sink: std_string_sink
+{
+    enum { bulk = 1 };
+    bool unicode_;
+    lower_sink(std::string &s, bool unicode):
+        std_string_sink(s), unicode_(unicode) {}
+    template<size_t n> void write(const unsigned char *p) {
+        big_buf_sink::write<n>(p);
+    }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+        return plain_run<non_ascii_class, ascii_lower_map>(i, end);
+    }
+    // BMP simple lowercase mapping
+    template<size_t n> void write_lower(const unsigned char *p) {
+        if (!unicode_)
+            return big_buf_sink::write<n>(p);
+        unsigned long cp = utf8_decode<n>(p);
+        unsigned long lower =
+            (cp + lower_blocks[lower_index[cp >> 8]][cp & 0xff]) & 0xffff;
+        if (lower == cp)
+            return big_buf_sink::write<n>(p);
+        if (lower < 0x80) {
+            p_[0] = lower;
+            p_ += 1;
+        } else if (lower < 0x800) {
+            p_[0] = 0xc0 | (lower >> 6);
+            p_[1] = 0x80 | (lower & 0x3f);
+            p_ += 2;
+        } else {
+            p_[0] = 0xe0 | (lower >> 12);
+            p_[1] = 0x80 | ((lower >> 6) & 0x3f);
+            p_[2] = 0x80 | (lower & 0x3f);
+            p_ += 3;
+        }
+    }
+};
+template<> void lower_sink::write<1>(const unsigned char *p) {
+    p_[0] = ascii_lower_map::map(p[0]);
+    p_ += 1;
+}
+template<> void lower_sink::write<2>(const unsigned char *p) {
+    write_lower<2>(p);
+}
+template<> void lower_sink::write<3>(const unsigned char *p) {
+    write_lower<3>(p);
+}
+
+// LF and non-ASCII bytes
+struct newline_class
+{
+    static bool special(unsigned char c) { return c > 0x7f || c == '\n'; }
+#if __SSE2__
+    static __m128i special(__m128i v) {
+        return _mm_or_si128(v, simd_eq(v, '\n'));
+    }
+#endif
+};
+
+// Record line ends while fixing (see fix_utf8_lines)
+struct lines_sink: std_string_sink
+{
+    enum { bulk = 1 };
+    std::vector<size_t> &line_ends_;
+    lines_sink(std::string &s, std::vector<size_t> &line_ends):
+        std_string_sink(s), line_ends_(line_ends) {}
+    template<size_t n> void write(const unsigned char *p) {
+        big_buf_sink::write<n>(p);
+    }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+        // LFs are handled here as well, lines are often short
+        end = bounded_run(i, end);
+        for (;;) {
+            i = copy_plain<newline_class>(p_, i, end);
+            if (i == end || *i != '\n')
+                return i;
+            *p_++ = '\n';
+            i++;
+            line_ends_.push_back(cur_off());
+        }
+    }
+};
+template<> void lines_sink::write<1>(const unsigned char *p) {
+    big_buf_sink::write<1>(p);
+    if (p[0] == '\n')
+        line_ends_.push_back(cur_off());
+}
+
+// JSON structure: a quote starts a string, non-ASCII bytes are checked
+// (and copied verbatim, see json_sink)
+struct json_outside_class
+{
+    static bool special(unsigned char c) { return c > 0x7f || c == '"'; }
+#if __SSE2__
+    static __m128i special(__m128i v) {
+        return _mm_or_si128(v, simd_eq(v, '"'));
+    }
+#endif
+};
+
+// JSON string contents: the closing quote, a backslash escape, non-ASCII
+// bytes to fix and LF (which can't appear in a string, see json_sink)
+struct json_string_class
+{
+    static bool special(unsigned char c) {
+        return c > 0x7f || c == '"' || c == '\\' || c == '\n';
+    }
+#if __SSE2__
+    static __m128i special(__m128i v) {
+        return _mm_or_si128(
+            _mm_or_si128(v, simd_eq(v, '"')),
+            _mm_or_si128(simd_eq(v, '\\'), simd_eq(v, '\n')));
+    }
+#endif
+};
+
+// NDJSON (see fix_utf8_ndjson). Tracks whether we are inside a string;
+// a LF always ends a record so that a malformed one doesn't affect the
+// rest. Up to 13 bytes for two \udcXX escapes after a backslash.
+struct json_sink: std_string_sink
+{
+    enum { bulk = 1 };
+    enum { outside, string, escape };
+    int state_;
+    bool escape_u_;
+    json_sink(std::string &s, bool escape_u):
+        std_string_sink(s), state_(outside), escape_u_(escape_u) {}
+    bool check_capacity()
+    {
+        reserve(13);
+        return true;
+    }
+    template<size_t n> void write(const unsigned char *p) {
+        if (state_ == escape)
+            state_ = string;
+        big_buf_sink::write<n>(p);
+    }
+    void write_bad(const unsigned char *p) {
+        static const char hex[] = "0123456789abcdef";
+        if (state_ == outside) {
+            // not ours to fix
+            return big_buf_sink::write<1>(p);
+        }
+        // a backslash before an invalid byte stands for itself, escape it
+        // so that it doesn't combine with what we emit
+        if (state_ == escape)
+            put("\\", 1);
+        state_ = string;
+        if (!escape_u_)
+            return big_buf_sink::write_bad(p);
+        put("\\udc", 4);
+        p_[0] = hex[p[0] >> 4];
+        p_[1] = hex[p[0] & 0xf];
+        p_ += 2;
+    }
+    // state after an ASCII byte
+    void next_state(unsigned char c) {
+        if (c == '\n') {
+            state_ = outside;
+        } else if (state_ == outside) {
+            if (c == '"')
+                state_ = string;
+        } else if (state_ == escape) {
+            state_ = string;
+        } else if (c == '"') {
+            state_ = outside;
+        } else if (c == '\\') {
+            state_ = escape;
+        }
+    }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+        // quotes and escapes are handled here as well, strings are often
+        // short
+        end = bounded_run(i, end);
+        for (;;) {
+            if (state_ == outside)
+                i = copy_plain<json_outside_class>(p_, i, end);
+            else if (state_ == string)
+                i = copy_plain<json_string_class>(p_, i, end);
+            if (i == end || *i > 0x7f)
+                return i;
+            next_state(*i);
+            *p_++ = *i++;
+        }
+    }
+};
+template<> void json_sink::write<1>(const unsigned char *p) {
+    next_state(p[0]);
+    big_buf_sink::write<1>(p);
+}
+
+// CSV field contents: quote, delimiter, line breaks, non-ASCII
+struct csv_class
+{
+    static bool special(unsigned char c) {
+        return c > 0x7f || c == '"' || c == ',' || c == '\r' || c == '\n';
+    }
+#if __SSE2__
+    static __m128i special(__m128i v) {
+        return _mm_or_si128(
+            _mm_or_si128(v, simd_eq(v, '"')),
+            _mm_or_si128(simd_eq(v, ','),
+                _mm_or_si128(simd_eq(v, '\r'), simd_eq(v, '\n'))));
+    }
+#endif
+};
+
+// TSV field contents: TAB, line breaks, backslash, non-ASCII
+struct tsv_class
+{
+    static bool special(unsigned char c) {
+        return c > 0x7f || c == '\t' || c == '\r' || c == '\n' ||
+            c == '\\';
+    }
+#if __SSE2__
+    static __m128i special(__m128i v) {
+        return _mm_or_si128(
+            _mm_or_si128(v, simd_eq(v, '\t')),
+            _mm_or_si128(simd_eq(v, '\\'),
+                _mm_or_si128(simd_eq(v, '\r'), simd_eq(v, '\n'))));
+    }
+#endif
+};
+
+// CSV/TSV output (see fix_utf8_csv), the engine is run once per field.
+// A CSV field is quoted once a special character is found in it: the
+// part output so far is moved by one byte (it is still in cache).
+struct csv_sink: std_string_sink
+{
+    enum { bulk = 1 };
+    bool tsv_, quoted_;
+    size_t field_off_;
+    csv_sink(std::string &s, bool tsv):
+        std_string_sink(s), tsv_(tsv), quoted_(false), field_off_(0) {}
+    template<size_t n> void write(const unsigned char *p) {
+        big_buf_sink::write<n>(p);
+    }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+        if (tsv_)
+            return plain_run<tsv_class>(i, end);
+        return plain_run<csv_class>(i, end);
+    }
+    void begin_field() {
+        reserve(6);
+        field_off_ = cur_off();
+        quoted_ = false;
+    }
+    void end_field(bool end_of_record) {
+        reserve(6);
+        if (quoted_)
+            put("\"", 1);
+        if (end_of_record)
+            put(tsv_ ? "\n" : "\r\n", tsv_ ? 1 : 2);
+        else
+            put(tsv_ ? "\t" : ",", 1);
+    }
+    void quote() {
+        unsigned char *field = begin() + field_off_;
+        memmove(field + 1, field, p_ - field);
+        field[0] = '"';
+        p_ += 1;
+        quoted_ = true;
+    }
+};
+template<> void csv_sink::write<1>(const unsigned char *p) {
+    if (tsv_) {
+        switch (p[0]) {
+            case '\t': put("\\t", 2); return;
+            case '\n': put("\\n", 2); return;
+            case '\r': put("\\r", 2); return;
+            case '\\': put("\\\\", 2); return;
+        }
+    } else {
+        switch (p[0]) {
+            case '"':
+                if (!quoted_)
+                    quote();
+                put("\"", 1);
+                break;
+            case ',': case '\r': case '\n':
+                if (!quoted_)
+                    quote();
+                break;
+        }
+    }
+    big_buf_sink::write<1>(p);
+}
+
+// Collect statistics for sniff_utf8, no output. ASCII runs are scanned
+// with SSE2, counting NULs by offset parity.
+struct sniff_sink
+{
+    enum { bulk = 1 };
+    const unsigned char *begin_;
+    utf8_sniff &res_;
+    // invalid bytes not defined in cp1252 either
+    size_t cp1252_undefined_;
+    sniff_sink(const unsigned char *begin, utf8_sniff &res):
+        begin_(begin), res_(res), cp1252_undefined_(0) {}
+    bool check_capacity() { return true; }
+    void count_nul(const unsigned char *p) {
+        if ((p - begin_) & 1)
+            res_.nul_odd++;
+        else
+            res_.nul_even++;
+    }
+    template<size_t n> void write(const unsigned char *p) {
+        res_.multibyte++;
+    }
+    void write_bad(const unsigned char *p) {
+        res_.invalid++;
+        res_.invalid_hist[(p[0] >> 4) & 7]++;
+        if (p[0] == 0x81 || p[0] == 0x8d || p[0] == 0x8f || p[0] == 0x90 ||
+            p[0] == 0x9d)
+            cp1252_undefined_++;
+    }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+        const unsigned char *start = i;
+#if __SSE2__
+        while (end - i >= 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(i));
+            unsigned high = _mm_movemask_epi8(v);
+            unsigned nul = _mm_movemask_epi8(
+                _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+            unsigned n = __builtin_ctz(high | 0x10000);
+            nul &= (1u << n) - 1;
+            unsigned even = (i - begin_) & 1 ? 0xaaaa : 0x5555;
+            res_.nul_even += __builtin_popcount(nul & even);
+            res_.nul_odd += __builtin_popcount(nul & ~even);
+            i += n;
+            if (n < 16)
+                break;
+        }
+#endif
+        for (; i < end && *i < 0x80; i++) {
+            if (!*i)
+                count_nul(i);
+        }
+        res_.ascii += i - start;
+        return i;
+    }
+};
+template<> void sniff_sink::write<1>(const unsigned char *p) {
+    res_.ascii++;
+    if (!p[0])
+        count_nul(p);
+}
+
+// Kernels for large inputs, picked per block by fix_utf8_adaptive:
+//
+// - ascii-run: copies ASCII runs with SSE2 (ASCII is common);
+// - validate-copy: validates a chunk without producing output and copies
+//   the valid prefix with memcpy (valid multibyte text);
+// - dense-error: the plain engine (frequent invalid bytes, short runs).
+//
+// All of them produce exactly the same output.
+std::atomic<uint64_t> kernel_blocks[3];
+
+struct ascii_run_sink: std_string_sink
+{
+    enum { bulk = 1 };
+    using std_string_sink::std_string_sink;
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+        return plain_run<non_ascii_class>(i, end);
+    }
+};
+
+// Finds the first invalid byte (bad_), stops there
+struct validate_sink
+{
+    enum { bulk = 1 };
+    const unsigned char *bad_;
+    validate_sink(): bad_(0) {}
+    bool check_capacity() { return !bad_; }
+    template<size_t n> void write(const unsigned char *p) {}
+    void write_bad(const unsigned char *p) {
+        if (!bad_)
+            bad_ = p;
+    }
+    const unsigned char *copy_run(const unsigned char *i,
+                                  const unsigned char *end) {
+#if __SSE2__
+        while (end - i >= 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(i));
+            unsigned mask = _mm_movemask_epi8(v);
+            if (mask)
+                return i + __builtin_ctz(mask);
+            i += 16;
+        }
+#endif
+        while (i < end && *i < 0x80)
+            i++;
+        return i;
+    }
+};
+
+// The engine advances by one byte on an invalid byte and keeps no other
+// state, hence restarting after it is the same as carrying on.
+void validate_copy(std_string_sink &sink,
+                   const unsigned char *i, const unsigned char *end)
+{
+    while (i < end) {
+        // small chunks, memcpy reads them from L1
+        const unsigned char *b = block_end(i, end, 4096);
+        validate_sink v;
+        fix_utf8_engine(v, i, b);
+        const unsigned char *stop = v.bad_ ? v.bad_ : b;
+        sink.reserve(stop - i);
+        memcpy(sink.p_, i, stop - i);
+        sink.p_ += stop - i;
+        i = stop;
+        if (v.bad_) {
+            sink.check_capacity();
+            sink.write_bad(i);
+            i++;
+        }
+    }
+}
+
+enum kernel { kernel_ascii_run, kernel_validate_copy, kernel_dense_error };
+
+kernel pick_kernel(const unsigned char *i, const unsigned char *end)
+{
+    utf8_sniff s = sniff_utf8(i, end, 1024);
+    // at least 1/4 ASCII bytes, runs pay off even in random bytes
+    if (s.ascii * 4 >= s.bytes)
+        return kernel_ascii_run;
+    // more than ~1.5% invalid bytes, validation restarts too often
+    if (s.invalid * 64 > s.bytes)
+        return kernel_dense_error;
+    return kernel_validate_copy;
+}
+
+const size_t adaptive_block = 64 * 1024;
+const size_t adaptive_resample = 16;  // blocks
+
+void fix_utf8_adaptive(std::string &result,
+                       const unsigned char *i, const unsigned char *end)
+{
+    kernel k = kernel_dense_error;
+    for (size_t n = 0; i < end; n++) {
+        const unsigned char *b = block_end(i, end, adaptive_block);
+        if (n % adaptive_resample == 0)
+            k = pick_kernel(i, b);
+        kernel_blocks[k].fetch_add(1, std::memory_order_relaxed);
+        if (k == kernel_ascii_run) {
+            ascii_run_sink sink(result);
+            fix_utf8_engine(sink, i, b);
+            result.resize(sink.cur_off());
+        } else if (k == kernel_validate_copy) {
+            std_string_sink sink(result);
+            validate_copy(sink, i, b);
+            result.resize(sink.cur_off());
+        } else {
+            std_string_sink sink(result);
+            fix_utf8_engine(sink, i, b);
+            result.resize(sink.cur_off());
+        }
+        i = b;
+    }
+}
+
 } // namespace {
 
 size_t fix_utf8(void *buf,
@@ -275,6 +1567,8 @@ void fix_utf8(std::string &result,
               const unsigned char *i, const unsigned char *end)
 {
     result.reserve(result.size() + (end - i));
+    if ((size_t)(end - i) >= adaptive_block)
+        return fix_utf8_adaptive(result, i, end);
     std_string_sink sink(result);
     fix_utf8_engine(sink, i, end);
     result.resize(sink.cur_off());
@@ -287,3 +1581,256 @@ void fix_utf8(std::vector<unsigned char> &result,
     std_vector_sink sink(result);
     fix_utf8_engine(sink, i, end);
 }
+
+void fix_utf8_xml(std::string &result,
+                  const unsigned char *i, const unsigned char *end,
+                  xml_invalid invalid)
+{
+    result.reserve(result.size() + (end - i));
+    xml_sink sink(result, invalid == xml_drop);
+    fix_utf8_engine(sink, i, end);
+    result.resize(sink.cur_off());
+}
+
+void fix_utf8_percent(std::string &result,
+                      const unsigned char *i, const unsigned char *end,
+                      unsigned flags)
+{
+    result.reserve(result.size() + (end - i));
+    percent_sink sink(result, flags);
+    fix_utf8_engine(sink, i, end);
+    result.resize(sink.cur_off());
+}
+
+void fix_utf8_ctl(std::string &result,
+                  const unsigned char *i, const unsigned char *end,
+                  unsigned flags)
+{
+    result.reserve(result.size() + (end - i));
+    ctl_sink sink(result, flags);
+    fix_utf8_engine(sink, i, end);
+    sink.finish();
+    result.resize(sink.cur_off());
+}
+
+size_t fix_utf8_truncate(void *buf, size_t max_out_bytes,
+                         const unsigned char *i, const unsigned char *end,
+                         size_t *consumed, const char *ellipsis)
+{
+    size_t ellipsis_len = ellipsis ? strlen(ellipsis) : 0;
+    if (ellipsis_len > max_out_bytes) {
+        // no room for the ellipsis
+        ellipsis_len = 0;
+        ellipsis = 0;
+    }
+    truncating_sink sink(buf, max_out_bytes, ellipsis_len, i);
+    fix_utf8_engine(sink, i, end);
+    const unsigned char *stop = end;
+    if (sink.stop_) {
+        stop = sink.stop_;
+        if (ellipsis) {
+            stop = sink.mark_in_;
+            sink.p_ = sink.mark_;
+            sink.put(ellipsis, ellipsis_len);
+        }
+    }
+    if (consumed)
+        *consumed = stop - i;
+    return sink.p_ - static_cast<const unsigned char *>(buf);
+}
+
+void fix_utf8(std::string &result,
+              const unsigned char *i, const unsigned char *end,
+              fix_utf8_stats &stats)
+{
+    result.reserve(result.size() + (end - i));
+    stats_sink<std_string_sink> sink(result);
+    fix_utf8_engine(sink, i, end);
+    result.resize(sink.cur_off());
+    stats.code_points = sink.code_points_;
+    stats.width = sink.width_;
+}
+
+uint64_t fix_utf8_hash(std::string &result,
+                       const unsigned char *i, const unsigned char *end,
+                       uint64_t seed)
+{
+    result.reserve(result.size() + (end - i));
+    hash_sink<std_string_sink> sink(result, seed);
+    fix_utf8_engine(sink, i, end);
+    uint64_t hash = sink.finish();
+    result.resize(sink.cur_off());
+    return hash;
+}
+
+uint64_t xxhash64(const void *p, size_t size, uint64_t seed)
+{
+    const unsigned char *i = static_cast<const unsigned char *>(p);
+    xxh64 hash(seed);
+    for (size_t n = size / 32; n; n--, i += 32)
+        hash.stripe(i);
+    return hash.finish(i, size);
+}
+
+void fix_utf8(std::string &result,
+              const unsigned char *i, const unsigned char *end,
+              fix_utf8_crc &crc)
+{
+#if __x86_64__
+    if (__builtin_cpu_supports("sse4.2"))
+        return fix_utf8_crc_impl<crc32c_sse42>(result, i, end, crc);
+#endif
+    fix_utf8_crc_impl<crc32c_table>(result, i, end, crc);
+}
+
+uint32_t crc32c(const void *p, size_t size, uint32_t crc)
+{
+    const unsigned char *i = static_cast<const unsigned char *>(p);
+#if __x86_64__
+    if (__builtin_cpu_supports("sse4.2"))
+        return ~crc32c_sse42_update(~crc, i, size);
+#endif
+    return ~crc32c_table::update(~crc, i, size);
+}
+
+void fix_utf8_lower(std::string &result,
+                    const unsigned char *i, const unsigned char *end,
+                    lower_mode mode)
+{
+    result.reserve(result.size() + (end - i));
+    lower_sink sink(result, mode == lower_unicode);
+    fix_utf8_engine(sink, i, end);
+    result.resize(sink.cur_off());
+}
+
+void fix_utf8_lines(std::string &result, std::vector<size_t> &line_ends,
+                    const unsigned char *i, const unsigned char *end)
+{
+    result.reserve(result.size() + (end - i));
+    lines_sink sink(result, line_ends);
+    fix_utf8_engine(sink, i, end);
+    result.resize(sink.cur_off());
+}
+
+void fix_utf8_ndjson(std::string &result,
+                     const unsigned char *i, const unsigned char *end,
+                     json_invalid invalid)
+{
+    result.reserve(result.size() + (end - i));
+    json_sink sink(result, invalid == json_escape_u);
+    fix_utf8_engine(sink, i, end);
+    result.resize(sink.cur_off());
+}
+
+void fix_utf8_csv(std::string &result,
+                  const unsigned char *i, const size_t *field_ends,
+                  size_t fields, size_t columns, csv_format format)
+{
+    result.reserve(result.size() + (fields ? field_ends[fields - 1] : 0));
+    csv_sink sink(result, format == tsv_escaped);
+    size_t begin = 0;
+    for (size_t f = 0; f < fields; f++) {
+        sink.begin_field();
+        fix_utf8_engine(sink, i + begin, i + field_ends[f]);
+        sink.end_field((columns && (f + 1) % columns == 0) ||
+                       f + 1 == fields);
+        begin = field_ends[f];
+    }
+    result.resize(sink.cur_off());
+}
+
+utf_bom detect_bom(const unsigned char *i, const unsigned char *end)
+{
+    size_t size = end - i;
+    if (size >= 4 && !memcmp(i, "\x00\x00\xfe\xff", 4))
+        return bom_utf32be;
+    if (size >= 4 && !memcmp(i, "\xff\xfe\x00\x00", 4))
+        return bom_utf32le;
+    if (size >= 3 && !memcmp(i, "\xef\xbb\xbf", 3))
+        return bom_utf8;
+    if (size >= 2 && !memcmp(i, "\xfe\xff", 2))
+        return bom_utf16be;
+    if (size >= 2 && !memcmp(i, "\xff\xfe", 2))
+        return bom_utf16le;
+    return bom_none;
+}
+
+utf_bom fix_utf8_bom(std::string &result,
+                     const unsigned char *i, const unsigned char *end)
+{
+    utf_bom bom = detect_bom(i, end);
+    if (bom == bom_utf8)
+        i += 3;
+    else if (bom != bom_none)
+        return bom;
+    fix_utf8(result, i, end);
+    return bom;
+}
+
+fix_utf8_status fix_utf8_checked(std::string &result,
+                                 const unsigned char *i,
+                                 const unsigned char *end,
+                                 const fix_utf8_limits &limits,
+                                 size_t *consumed)
+{
+    const unsigned char *begin = i;
+    fix_utf8_status status = fix_utf8_ok;
+    result.reserve(result.size() + (end - i));
+    invalid_count_sink<std_string_sink> sink(result);
+    while (i < end) {
+        const unsigned char *b = block_end(i, end, 4096);
+        fix_utf8_engine(sink, i, b);
+        i = b;
+        if (sink.invalid_ > limits.max_invalid_bytes ||
+            sink.invalid_ > limits.max_invalid_ratio * (i - begin)) {
+            status = fix_utf8_binary;
+            break;
+        }
+    }
+    result.resize(sink.cur_off());
+    if (consumed)
+        *consumed = i - begin;
+    return status;
+}
+
+utf8_sniff sniff_utf8(const unsigned char *i, const unsigned char *end,
+                      size_t max_bytes)
+{
+    utf8_sniff res = utf8_sniff();
+    // block_end needs room for a whole sequence
+    const unsigned char *stop =
+        block_end(i, end, std::max<size_t>(max_bytes, 4));
+    sniff_sink sink(i, res);
+    fix_utf8_engine(sink, i, stop);
+    res.bytes = stop - i;
+    if (!res.bytes)
+        return res;
+
+    // Bytes not defined in cp1252 are unlikely in cp1252 text
+    size_t high = res.bytes - res.ascii;
+    size_t cp1252_undefined = sink.cp1252_undefined_;
+    // NULs are valid but unlikely in text
+    double text = 1.0 - (double)(res.nul_even + res.nul_odd) / res.bytes;
+    res.utf8 = high ? text * (high - res.invalid) / high : text;
+    res.cp1252 = high ?
+        text * (res.invalid - std::min(res.invalid, cp1252_undefined)) / high :
+        text;
+    // UTF-16 text has NULs predominantly at either even or odd offsets
+    size_t units = res.bytes / 2;
+    size_t skew = res.nul_even > res.nul_odd ?
+        res.nul_even - res.nul_odd : res.nul_odd - res.nul_even;
+    res.utf16 = units ? std::min(1.0, (double)skew / units) : 0.0;
+    return res;
+}
+
+fix_utf8_kernel_counters fix_utf8_kernels()
+{
+    fix_utf8_kernel_counters res;
+    res.ascii_run = kernel_blocks[kernel_ascii_run].load(
+        std::memory_order_relaxed);
+    res.validate_copy = kernel_blocks[kernel_validate_copy].load(
+        std::memory_order_relaxed);
+    res.dense_error = kernel_blocks[kernel_dense_error].load(
+        std::memory_order_relaxed);
+    return res;
+}
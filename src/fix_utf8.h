@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -23,3 +24,178 @@ size_t fix_utf8(void **pbuf,
                 const unsigned char *i, const unsigned char *end);
 void fix_utf8(std::vector<unsigned char> &result,
               const unsigned char *i, const unsigned char *end);
+
+// XML 1.0 safe output. Markup characters <&>"' are replaced with the
+// predefined entities. Invalid bytes and characters not allowed in XML 1.0
+// (C0 controls except TAB, LF and CR; U+FFFE, U+FFFF) are replaced with
+// U+FFFD or dropped (UTF-8B isn't an option: surrogates aren't allowed
+// either).
+enum xml_invalid { xml_replace, xml_drop };
+void fix_utf8_xml(std::string &result,
+                  const unsigned char *i, const unsigned char *end,
+                  xml_invalid invalid = xml_replace);
+
+// Percent-encoded output for URLs and HTTP header values. Invalid bytes
+// and ASCII controls are emitted as %XX instead of UTF-8B. "%" is always
+// encoded (as %25) so that escapes of invalid bytes can't be confused
+// with literal text, and so is space unless pct_keep_space is given
+// (a raw space ends an HTTP request target). With pct_non_ascii valid
+// multibyte sequences are encoded as well, with pct_reserved everything
+// but RFC 3986 unreserved characters (ALPHA / DIGIT / "-" / "." / "_" /
+// "~") is, space included.
+enum { pct_non_ascii = 1, pct_reserved = 2, pct_keep_space = 4 };
+void fix_utf8_percent(std::string &result,
+                      const unsigned char *i, const unsigned char *end,
+                      unsigned flags = 0);
+
+// Terminal log output. C0 controls except TAB and LF, DEL and C1 controls
+// (U+0080..U+009F) are dropped, or escaped as \xNN (C0, DEL) and \u00NN
+// (C1) with ctl_escape. With ctl_strip_csi ANSI CSI sequences
+// (ESC [ or U+009B, parameters, final byte) are removed entirely.
+enum { ctl_escape = 1, ctl_strip_csi = 2 };
+void fix_utf8_ctl(std::string &result,
+                  const unsigned char *i, const unsigned char *end,
+                  unsigned flags = 0);
+
+// Write at most max_out_bytes to buf, never splitting a character or
+// a UTF-8B escape. Returns the output size; the number of input bytes
+// processed is stored in *consumed. If the output had to be cut and an
+// ellipsis is given (ex: "..." or U+2026), the room for it is reserved
+// within max_out_bytes and it is appended.
+size_t fix_utf8_truncate(void *buf, size_t max_out_bytes,
+                         const unsigned char *i, const unsigned char *end,
+                         size_t *consumed = 0, const char *ellipsis = 0);
+
+// Statistics of the output: the number of code points (an UTF-8B escape
+// counts as one) and the display width in terminal columns (East Asian
+// Wide and Fullwidth characters take 2, combining marks and controls 0,
+// UTF-8B escapes 1).
+struct fix_utf8_stats
+{
+    size_t code_points;
+    size_t width;
+};
+void fix_utf8(std::string &result,
+              const unsigned char *i, const unsigned char *end,
+              fix_utf8_stats &stats);
+
+// Also compute XXH64 of the output (the appended part) while it is being
+// produced, saving a pass over the result.
+uint64_t fix_utf8_hash(std::string &result,
+                       const unsigned char *i, const unsigned char *end,
+                       uint64_t seed = 0);
+
+// XXH64 of a buffer, same as fix_utf8_hash computes
+uint64_t xxhash64(const void *p, size_t size, uint64_t seed = 0);
+
+// Also compute CRC32C of the input and of the output (the appended part)
+// in the same pass. Uses SSE4.2 if available.
+struct fix_utf8_crc
+{
+    uint32_t input;
+    uint32_t output;
+};
+void fix_utf8(std::string &result,
+              const unsigned char *i, const unsigned char *end,
+              fix_utf8_crc &crc);
+
+// CRC32C of a buffer, crc is the value for the preceding data if any
+uint32_t crc32c(const void *p, size_t size, uint32_t crc = 0);
+
+// Lowercased output for case-insensitive keys. ASCII letters are always
+// folded; with lower_unicode 2- and 3-byte sequences (the BMP) are
+// mapped with Unicode simple lowercase mapping.
+enum lower_mode { lower_unicode, lower_ascii };
+void fix_utf8_lower(std::string &result,
+                    const unsigned char *i, const unsigned char *end,
+                    lower_mode mode = lower_unicode);
+
+// Line-oriented bulk mode: the offset in result past each LF is appended
+// to line_ends. An escape never straddles a line boundary (LF is never
+// a part of a sequence, invalid bytes are escaped one by one).
+void fix_utf8_lines(std::string &result, std::vector<size_t> &line_ends,
+                    const unsigned char *i, const unsigned char *end);
+
+// Newline-delimited JSON: only the contents of strings are fixed, with
+// invalid bytes encoded either in UTF-8B or as \udcXX escapes (the same
+// code points); the structure is copied verbatim. A backslash followed by
+// an invalid byte is itself escaped (\\). A LF ends a record even if
+// a string isn't terminated.
+enum json_invalid { json_utf8b, json_escape_u };
+void fix_utf8_ndjson(std::string &result,
+                     const unsigned char *i, const unsigned char *end,
+                     json_invalid invalid = json_utf8b);
+
+// CSV/TSV export of a table. Field values are stored back to back
+// starting at i, field_ends[k] is the end offset of the field #k; every
+// columns fields make a record (with 0 all of them make one). CSV fields
+// containing a quote, a comma or a line break are quoted (RFC 4180,
+// records end with CRLF); in TSV TAB, LF, CR and backslash are escaped
+// as \t, \n, \r and \\ (records end with LF).
+enum csv_format { csv_quoted, tsv_escaped };
+void fix_utf8_csv(std::string &result,
+                  const unsigned char *i, const size_t *field_ends,
+                  size_t fields, size_t columns,
+                  csv_format format = csv_quoted);
+
+// Byte order mark at the beginning of the input (UTF-32 is checked first,
+// FF FE 00 00 is UTF-32LE)
+enum utf_bom {
+    bom_none, bom_utf8, bom_utf16le, bom_utf16be, bom_utf32le, bom_utf32be
+};
+utf_bom detect_bom(const unsigned char *i, const unsigned char *end);
+
+// Same as fix_utf8 (std::string) but a leading UTF-8 BOM is stripped.
+// If the input starts with a UTF-16/32 BOM nothing is done: it isn't
+// UTF-8, transcode it instead. Returns the BOM found.
+utf_bom fix_utf8_bom(std::string &result,
+                     const unsigned char *i, const unsigned char *end);
+
+// Same as fix_utf8 (std::string) but stops early on inputs which look
+// binary: once there are more than max_invalid_bytes invalid bytes or
+// they make more than max_invalid_ratio of the input consumed so far.
+// Checked once per block (4KB) of input. The output covers the consumed
+// part of the input.
+struct fix_utf8_limits
+{
+    size_t max_invalid_bytes;
+    double max_invalid_ratio;
+};
+enum fix_utf8_status { fix_utf8_ok, fix_utf8_binary };
+fix_utf8_status fix_utf8_checked(std::string &result,
+                                 const unsigned char *i,
+                                 const unsigned char *end,
+                                 const fix_utf8_limits &limits,
+                                 size_t *consumed = 0);
+
+// Statistics of the first max_bytes of the input to tell UTF-8 from
+// legacy encodings before fixing it. The sample ends on a sequence
+// boundary at or before max_bytes (taken as 4 if less). Confidences are
+// in 0..1 (pure ASCII is both UTF-8 and cp1252).
+struct utf8_sniff
+{
+    size_t bytes;             // examined
+    size_t ascii;             // ASCII bytes
+    size_t multibyte;         // valid multibyte sequences
+    size_t invalid;           // invalid bytes,
+    size_t invalid_hist[8];   // ... by high nibble (0x8 .. 0xf)
+    size_t nul_even;          // NULs at even offsets
+    size_t nul_odd;           // NULs at odd offsets
+    double utf8;              // share of non-ASCII bytes that are valid
+    double cp1252;            // share of non-ASCII bytes that are invalid
+                              // UTF-8 but defined in cp1252
+    double utf16;             // NULs skew to either even or odd offsets
+};
+utf8_sniff sniff_utf8(const unsigned char *i, const unsigned char *end,
+                      size_t max_bytes = 4096);
+
+// fix_utf8 (std::string overload) picks a kernel for every 64KB block of
+// a large input, based on a sample taken every 1MB. Counts blocks
+// processed by each kernel, process-wide.
+struct fix_utf8_kernel_counters
+{
+    uint64_t ascii_run;       // ASCII is common
+    uint64_t validate_copy;   // valid multibyte text
+    uint64_t dense_error;     // frequent invalid bytes
+};
+fix_utf8_kernel_counters fix_utf8_kernels();
@@ -2,6 +2,7 @@
 #include <gtest/gtest.h>
 #include <string>
 #include <initializer_list>
+#include <random>
 
 namespace {
 
@@ -47,6 +48,16 @@ SBit bad_code(unsigned long code_point, int width = 0)
     return bad_str(utf8_encode(code_point, width));
 }
 
+// helpers for testing fix_utf8 variants
+const unsigned char *ubegin(const std::string &s)
+{
+    return reinterpret_cast<const unsigned char *>(s.data());
+}
+const unsigned char *uend(const std::string &s)
+{
+    return ubegin(s) + s.size();
+}
+
 std::string utf8_encode(unsigned long code, int width)
 {
     if (width == 0) {
@@ -176,3 +187,686 @@ TEST(utf8_fix, surrogates) {
     fix_utf8_test({bad_code(0xdfff)});
     fix_utf8_test({0xdfff + 1});
 }
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+std::string fix_xml(const std::string &input,
+                    xml_invalid invalid = xml_replace)
+{
+    std::string result;
+    fix_utf8_xml(result, ubegin(input), uend(input), invalid);
+    return result;
+}
+} // namespace {
+
+TEST(utf8_fix_xml, markup) {
+    ASSERT_EQ("", fix_xml(""));
+    ASSERT_EQ("&lt;a href=&quot;x&quot;&gt;&amp;&apos;&lt;/a&gt;",
+              fix_xml("<a href=\"x\">&'</a>"));
+    // long enough for the vectorized scan
+    ASSERT_EQ("Hello, world! Hello, world! &amp; Hello, world!",
+              fix_xml("Hello, world! Hello, world! & Hello, world!"));
+}
+TEST(utf8_fix_xml, controls) {
+    ASSERT_EQ("\t\n\r\x7f", fix_xml("\t\n\r\x7f"));
+    ASSERT_EQ("a\xef\xbf\xbd" "b\xef\xbf\xbd" "c\xef\xbf\xbd",
+              fix_xml(std::string("a\0b\x1f" "c\x0b", 6)));
+    ASSERT_EQ("abc", fix_xml(std::string("a\0b\x1f" "c\x0b", 6), xml_drop));
+}
+TEST(utf8_fix_xml, non_characters) {
+    ASSERT_EQ(utf8_encode(0xfffd) + utf8_encode(0xfffd) + utf8_encode(0xfffd),
+              fix_xml(utf8_encode(0xfffe) + utf8_encode(0xffff) + "\xff"));
+    ASSERT_EQ(utf8_encode(0xfffd) + utf8_encode(0x10ffff),
+              fix_xml(utf8_encode(0xfffd) + utf8_encode(0x10ffff)));
+    ASSERT_EQ("[]", fix_xml("[\xf0\x90\x8d]", xml_drop));
+    // surrogates (each byte is invalid)
+    ASSERT_EQ(utf8_encode(0xfffd) + utf8_encode(0xfffd) + utf8_encode(0xfffd),
+              fix_xml("\xed\xa0\x80"));
+}
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+std::string fix_percent(const std::string &input, unsigned flags = 0)
+{
+    std::string result;
+    fix_utf8_percent(result, ubegin(input), uend(input), flags);
+    return result;
+}
+} // namespace {
+
+TEST(utf8_fix_percent, invalid) {
+    ASSERT_EQ("", fix_percent(""));
+    ASSERT_EQ("/a%2520b?q=%25E2", fix_percent("/a%20b?q=%E2"));
+    ASSERT_EQ("/caf%E9/%F0%90%8D", fix_percent("/caf\xe9/\xf0\x90\x8d"));
+    ASSERT_EQ("x%0D%0Ay%7F", fix_percent("x\r\ny\x7f"));
+    ASSERT_EQ("/" + utf8_encode(0x20ac) + "/%FF",
+              fix_percent("/" + utf8_encode(0x20ac) + "/\xff"));
+}
+TEST(utf8_fix_percent, percent_and_space) {
+    // a literal "%FF" and an invalid byte are told apart
+    ASSERT_EQ("%25FF%FF", fix_percent("%FF\xff"));
+    ASSERT_EQ("GET%20/a%20b", fix_percent("GET /a b"));
+    ASSERT_EQ("GET /a b%25", fix_percent("GET /a b%", pct_keep_space));
+    ASSERT_EQ("a%20b", fix_percent("a b", pct_reserved | pct_keep_space));
+    // long enough for the vectorized scan
+    ASSERT_EQ("0123456789abcdef%20%250123456789abcdef%20",
+              fix_percent("0123456789abcdef %0123456789abcdef "));
+    ASSERT_EQ("0123456789abcdef %250123456789abcdef ",
+              fix_percent("0123456789abcdef %0123456789abcdef ",
+                          pct_keep_space));
+}
+TEST(utf8_fix_percent, non_ascii) {
+    ASSERT_EQ("/%E2%82%AC/%F0%90%8D%88/%FF",
+              fix_percent("/" + utf8_encode(0x20ac) + "/" +
+                          utf8_encode(0x10348) + "/\xff", pct_non_ascii));
+}
+TEST(utf8_fix_percent, reserved) {
+    ASSERT_EQ("a%20b%2Fc%25d~e_f.g-h",
+              fix_percent("a b/c%d~e_f.g-h", pct_reserved));
+    // long enough for the vectorized scan
+    ASSERT_EQ("abcdefghijklmnopqrstuvwxyz0123456789%3F"
+              "ABCDEFGHIJKLMNOPQRSTUVWXYZ%26" + utf8_encode(0xe9),
+              fix_percent("abcdefghijklmnopqrstuvwxyz0123456789?"
+                          "ABCDEFGHIJKLMNOPQRSTUVWXYZ&" + utf8_encode(0xe9),
+                          pct_reserved));
+    ASSERT_EQ("%C3%A9%40", fix_percent(utf8_encode(0xe9) + "@",
+                                       pct_reserved | pct_non_ascii));
+}
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+std::string fix_ctl(const std::string &input, unsigned flags = 0)
+{
+    std::string result;
+    fix_utf8_ctl(result, ubegin(input), uend(input), flags);
+    return result;
+}
+} // namespace {
+
+TEST(utf8_fix_ctl, drop) {
+    ASSERT_EQ("", fix_ctl(""));
+    ASSERT_EQ("a\tb\nc", fix_ctl(std::string("a\tb\nc\r\0\x7f", 8)));
+    ASSERT_EQ("[31mred[0m", fix_ctl("\x1b[31mred\x1b[0m"));
+    // C1 controls, but not U+00A0
+    ASSERT_EQ("xy" + utf8_encode(0xa0),
+              fix_ctl("x" + utf8_encode(0x85) + "y" + utf8_encode(0x9f) +
+                      utf8_encode(0xa0)));
+    ASSERT_EQ(utf8b_encode("\xc2"), fix_ctl("\xc2"));
+}
+TEST(utf8_fix_ctl, dense) {
+    std::string input, expected;
+    for (int i = 0; i < 1000; i++) {
+        char c = (i * 7) % 128;
+        input.push_back(c);
+        if (c >= 0x20 ? c != 0x7f : c == '\t' || c == '\n')
+            expected.push_back(c);
+    }
+    ASSERT_EQ(expected, fix_ctl(input));
+}
+TEST(utf8_fix_ctl, escape) {
+    ASSERT_EQ("a\\x0db\\x7fc\\u0085\\x1b[1m",
+              fix_ctl("a\rb\x7f" "c" + utf8_encode(0x85) + "\x1b[1m",
+                      ctl_escape));
+}
+TEST(utf8_fix_ctl, strip_csi) {
+    ASSERT_EQ("red plain, still plain ok",
+              fix_ctl("\x1b[1;31mred\x1b[0m plain, still plain \x1b[38;5;208mok",
+                      ctl_strip_csi));
+    ASSERT_EQ("ab", fix_ctl("a" + utf8_encode(0x9b) + "2Jb", ctl_strip_csi));
+    // ESC not starting a CSI is just a control, so is a trailing ESC
+    ASSERT_EQ("\\x1b(B\\x1b", fix_ctl("\x1b(B\x1b", ctl_strip_csi | ctl_escape));
+    ASSERT_EQ("\\x1b" + utf8_encode(0x20ac),
+              fix_ctl("\x1b" + utf8_encode(0x20ac), ctl_strip_csi | ctl_escape));
+    // an interrupted CSI is dropped
+    ASSERT_EQ(utf8b_encode("\xff") + "x",
+              fix_ctl("\x1b[12\xffx", ctl_strip_csi));
+}
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+// output and the number of bytes consumed, "|" separated
+std::string fix_truncate(const std::string &input, size_t max_out_bytes,
+                         const char *ellipsis = 0)
+{
+    std::vector<char> buf(max_out_bytes + 1, '#');
+    size_t consumed = -1;
+    size_t res = fix_utf8_truncate(&buf[0], max_out_bytes,
+                                   ubegin(input), uend(input),
+                                   &consumed, ellipsis);
+    EXPECT_LE(res, max_out_bytes);
+    EXPECT_EQ('#', buf[max_out_bytes]);
+    return std::string(&buf[0], res) + "|" + std::to_string(consumed);
+}
+} // namespace {
+
+TEST(utf8_fix_truncate, fits) {
+    ASSERT_EQ("|0", fix_truncate("", 0));
+    ASSERT_EQ("|0", fix_truncate("", 10, "..."));
+    ASSERT_EQ("Hello|5", fix_truncate("Hello", 5));
+    ASSERT_EQ("Hello|5", fix_truncate("Hello", 5, "..."));
+}
+TEST(utf8_fix_truncate, cut) {
+    std::string euro = utf8_encode(0x20ac);
+    ASSERT_EQ("Hel|3", fix_truncate("Hello", 3));
+    ASSERT_EQ("ab|2", fix_truncate("ab" + euro, 4));
+    ASSERT_EQ("ab" + euro + "|5", fix_truncate("ab" + euro + "c", 5));
+    // never split a UTF-8B escape
+    ASSERT_EQ("ab|2", fix_truncate("ab\xff", 4));
+    ASSERT_EQ("ab" + utf8b_encode("\xff") + "|3",
+              fix_truncate("ab\xff\xfe", 7));
+    ASSERT_EQ("|0", fix_truncate(euro, 2));
+}
+TEST(utf8_fix_truncate, ellipsis) {
+    ASSERT_EQ("He...|2", fix_truncate("Hello, world", 5, "..."));
+    ASSERT_EQ("...|0", fix_truncate("Hello, world", 3, "..."));
+    // no room for the ellipsis
+    ASSERT_EQ("H|1", fix_truncate("Hello, world", 1, "..."));
+    std::string ell = utf8_encode(0x2026);
+    ASSERT_EQ("a" + ell + "|1",
+              fix_truncate("a\xff" "bcdef", 6, ell.c_str()));
+}
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+// output, code points and width, "|" separated
+std::string fix_stats(const std::string &input)
+{
+    std::string result;
+    fix_utf8_stats stats;
+    fix_utf8(result, ubegin(input), uend(input), stats);
+    return result + "|" + std::to_string(stats.code_points) +
+        "|" + std::to_string(stats.width);
+}
+} // namespace {
+
+TEST(utf8_fix_stats, ascii) {
+    ASSERT_EQ("|0|0", fix_stats(""));
+    ASSERT_EQ("Hello|5|5", fix_stats("Hello"));
+    ASSERT_EQ("a\tb\x7f|4|2", fix_stats("a\tb\x7f"));
+}
+TEST(utf8_fix_stats, width) {
+    // e + COMBINING ACUTE ACCENT
+    std::string accented = utf8_encode('e') + utf8_encode(0x301);
+    ASSERT_EQ(accented + "|2|1", fix_stats(accented));
+    // CJK, fullwidth, hangul, emoji
+    std::string wide = utf8_encode(0x4e2d) + utf8_encode(0xff21) +
+        utf8_encode(0xac00) + utf8_encode(0x1f600);
+    ASSERT_EQ(wide + "|4|8", fix_stats(wide));
+    // ZERO WIDTH SPACE, SOFT HYPHEN, Cyrillic, Greek
+    std::string narrow = utf8_encode(0x200b) + utf8_encode(0xad) +
+        utf8_encode(0x416) + utf8_encode(0x3a9);
+    ASSERT_EQ(narrow + "|4|3", fix_stats(narrow));
+}
+TEST(utf8_fix_stats, bad_bytes) {
+    ASSERT_EQ(utf8b_encode("\xff\xfe") + "x|3|3", fix_stats("\xff\xfex"));
+    ASSERT_EQ(utf8b_encode("\xe4\xb8") + "|2|2", fix_stats("\xe4\xb8"));
+}
+
+///////////////////////////////////////////////////////////////////////
+
+TEST(utf8_fix_hash, xxhash64) {
+    ASSERT_EQ(0xef46db3751d8e999ULL, xxhash64("", 0));
+    ASSERT_EQ(0x44bc2cf5ad770999ULL, xxhash64("abc", 3));
+}
+TEST(utf8_fix_hash, output) {
+    // all tail lengths and a few stripes, with escapes on stripe
+    // boundaries
+    std::string input;
+    for (int n = 0; n < 200; n++) {
+        std::string result = "prefix", expected = "prefix";
+        uint64_t hash = fix_utf8_hash(result, ubegin(input), uend(input), n);
+        fix_utf8(expected, ubegin(input), uend(input));
+        ASSERT_EQ(expected, result);
+        ASSERT_EQ(xxhash64(result.data() + 6, result.size() - 6, n), hash);
+        input += n % 7 ? std::string(1, 'a' + n % 26) : "\xff";
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+
+TEST(utf8_fix_crc, crc32c) {
+    ASSERT_EQ(0u, crc32c("", 0));
+    ASSERT_EQ(0xe3069283u, crc32c("123456789", 9));
+    ASSERT_EQ(0xe3069283u, crc32c("56789", 5, crc32c("1234", 4)));
+}
+TEST(utf8_fix_crc, input_output) {
+    std::string input;
+    for (int n = 0; n < 300; n++) {
+        std::string result = "prefix", expected = "prefix";
+        fix_utf8_crc crc;
+        fix_utf8(result, ubegin(input), uend(input), crc);
+        fix_utf8(expected, ubegin(input), uend(input));
+        ASSERT_EQ(expected, result);
+        ASSERT_EQ(crc32c(input.data(), input.size()), crc.input);
+        ASSERT_EQ(crc32c(result.data() + 6, result.size() - 6), crc.output);
+        input += n % 5 ? utf8_encode(n * 37) : "\xc0";
+    }
+}
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+std::string fix_lower(const std::string &input,
+                      lower_mode mode = lower_unicode)
+{
+    std::string result;
+    fix_utf8_lower(result, ubegin(input), uend(input), mode);
+    return result;
+}
+} // namespace {
+
+TEST(utf8_fix_lower, ascii) {
+    ASSERT_EQ("", fix_lower(""));
+    ASSERT_EQ("hello, world! @[`{", fix_lower("HeLLo, World! @[`{"));
+    // long enough for the vectorized path
+    ASSERT_EQ("abcdefghijklmnopqrstuvwxyz0123456789 abcdefghijklmnopqrstuvwxyz",
+              fix_lower("ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 "
+                        "abcdefghijklmnopqrstuvwxyz"));
+    ASSERT_EQ("abc" + utf8b_encode("\xff") + "d",
+              fix_lower("ABC\xff" "D"));
+}
+TEST(utf8_fix_lower, unicode) {
+    // Latin-1, Cyrillic, Greek
+    ASSERT_EQ(utf8_encode(0xe9) + utf8_encode(0x436) + utf8_encode(0x3c9),
+              fix_lower(utf8_encode(0xc9) + utf8_encode(0x416) +
+                        utf8_encode(0x3a9)));
+    ASSERT_EQ(utf8_encode(0xc9) + utf8_encode(0x416),
+              fix_lower(utf8_encode(0xc9) + utf8_encode(0x416),
+                        lower_ascii));
+    // length changes: KELVIN SIGN, CAPITAL I WITH DOT ABOVE, A WITH STROKE
+    ASSERT_EQ("ki" + utf8_encode(0x2c65),
+              fix_lower(utf8_encode(0x212a) + utf8_encode(0x130) +
+                        utf8_encode(0x23a)));
+    // fullwidth A, lowercase and uncased characters stay
+    ASSERT_EQ(utf8_encode(0xff41) + utf8_encode(0xdf) + utf8_encode(0x4e2d),
+              fix_lower(utf8_encode(0xff21) + utf8_encode(0xdf) +
+                        utf8_encode(0x4e2d)));
+}
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+// the lines of the output, "|" separated
+std::string fix_lines(const std::string &input)
+{
+    std::string result = "prefix\n";
+    std::vector<size_t> line_ends;
+    fix_utf8_lines(result, line_ends, ubegin(input), uend(input));
+    std::string expected = "prefix\n";
+    fix_utf8(expected, ubegin(input), uend(input));
+    EXPECT_EQ(expected, result);
+    std::string lines;
+    size_t begin = 7;
+    for (size_t line_end: line_ends) {
+        EXPECT_EQ('\n', result[line_end - 1]);
+        lines += result.substr(begin, line_end - begin) + "|";
+        begin = line_end;
+    }
+    return lines + result.substr(begin);
+}
+} // namespace {
+
+TEST(utf8_fix_lines, lines) {
+    ASSERT_EQ("", fix_lines(""));
+    ASSERT_EQ("\n|", fix_lines("\n"));
+    ASSERT_EQ("a\n|b\n|c", fix_lines("a\nb\nc"));
+    ASSERT_EQ("a much longer line, longer than a vector\n|\n|"
+              "another long line to take the vectorized path\n|",
+              fix_lines("a much longer line, longer than a vector\n\n"
+                        "another long line to take the vectorized path\n"));
+}
+TEST(utf8_fix_lines, escapes) {
+    ASSERT_EQ(utf8b_encode("\xe2\x82") + "\n|" + utf8_encode(0x20ac) + "\n|" +
+              utf8b_encode("\xff"),
+              fix_lines("\xe2\x82\n" + utf8_encode(0x20ac) + "\n\xff"));
+}
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+std::string fix_ndjson(const std::string &input,
+                       json_invalid invalid = json_utf8b)
+{
+    std::string result;
+    fix_utf8_ndjson(result, ubegin(input), uend(input), invalid);
+    return result;
+}
+} // namespace {
+
+TEST(utf8_fix_ndjson, strings) {
+    ASSERT_EQ("", fix_ndjson(""));
+    ASSERT_EQ("{\"k\":\"v" + utf8b_encode("\xff") + "\"}\n",
+              fix_ndjson("{\"k\":\"v\xff\"}\n"));
+    ASSERT_EQ("{\"k\":\"v\\udcff\\udcfe" + utf8_encode(0x20ac) + "\"}",
+              fix_ndjson("{\"k\":\"v\xff\xfe" + utf8_encode(0x20ac) + "\"}",
+                         json_escape_u));
+    // escaped quotes and backslashes don't end a string
+    ASSERT_EQ("[\"a\\\"\\\\" + utf8b_encode("\xc0") + "\",\"\\\"\"]",
+              fix_ndjson("[\"a\\\"\\\\\xc0\",\"\\\"\"]"));
+}
+TEST(utf8_fix_ndjson, backslash_before_invalid) {
+    // the backslash is escaped rather than combined with the replacement
+    ASSERT_EQ("[\"a\\\\" + utf8b_encode("\xff") + "b\"]",
+              fix_ndjson("[\"a\\\xff" "b\"]"));
+    ASSERT_EQ("[\"a\\\\\\udcff\\udc80b\"]",
+              fix_ndjson("[\"a\\\xff\x80" "b\"]", json_escape_u));
+    // an escaped backslash before an invalid byte is left alone
+    ASSERT_EQ("[\"\\\\\\udcff\"]",
+              fix_ndjson("[\"\\\\\xff\"]", json_escape_u));
+}
+TEST(utf8_fix_ndjson, structure) {
+    // bytes outside of strings are copied verbatim
+    ASSERT_EQ("{\"a\":1\xff}\n{\"b\":\"" + utf8b_encode("\xff") + "\"}\n",
+              fix_ndjson("{\"a\":1\xff}\n{\"b\":\"\xff\"}\n"));
+    // an unterminated string ends with the record
+    ASSERT_EQ("{\"a\":\"x\n{\xff:\"" + utf8b_encode("\xff") + "\"}",
+              fix_ndjson("{\"a\":\"x\n{\xff:\"\xff\"}"));
+    // long records for the vectorized path
+    std::string record = "{\"id\":12345,\"name\":\"a reasonably long name\","
+        "\"tags\":[\"first\",\"second\\\"quoted\\\"\"]}\n";
+    ASSERT_EQ(record + record, fix_ndjson(record + record));
+}
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+std::string fix_csv(std::initializer_list<std::string> fields,
+                    size_t columns, csv_format format = csv_quoted)
+{
+    std::string input;
+    std::vector<size_t> field_ends;
+    for (auto &field: fields) {
+        input += field;
+        field_ends.push_back(input.size());
+    }
+    std::string result;
+    fix_utf8_csv(result, ubegin(input), field_ends.data(),
+                 field_ends.size(), columns, format);
+    return result;
+}
+} // namespace {
+
+TEST(utf8_fix_csv, csv) {
+    ASSERT_EQ("", fix_csv({}, 2));
+    ASSERT_EQ("a,b\r\nc,\r\n", fix_csv({"a", "b", "c", ""}, 2));
+    ASSERT_EQ("\"a,b\",\"say \"\"hi\"\"\",\"x\ny\"\r\n",
+              fix_csv({"a,b", "say \"hi\"", "x\ny"}, 3));
+    // incomplete last record, escapes
+    ASSERT_EQ("1,2\r\n" + utf8b_encode("\xff") + "\r\n",
+              fix_csv({"1", "2", "\xff"}, 2));
+    // quoting late in a long field
+    ASSERT_EQ("\"a long field, longer than a vector\"\r\n",
+              fix_csv({"a long field, longer than a vector"}, 1));
+    // no column count, a single record
+    ASSERT_EQ("a,b,c\r\n", fix_csv({"a", "b", "c"}, 0));
+}
+TEST(utf8_fix_csv, tsv) {
+    ASSERT_EQ("a\\tb\tc\\\\d\n" + utf8b_encode("\xc0") + "\\r\\n\t\n",
+              fix_csv({"a\tb", "c\\d", "\xc0\r\n", ""}, 2, tsv_escaped));
+    ASSERT_EQ("\"quotes\", commas\n",
+              fix_csv({"\"quotes\", commas"}, 1, tsv_escaped));
+}
+
+///////////////////////////////////////////////////////////////////////
+
+TEST(utf8_fix_bom, detect) {
+    auto detect = [](const std::string &s) {
+        return detect_bom(ubegin(s), uend(s));
+    };
+    ASSERT_EQ(bom_none, detect(""));
+    ASSERT_EQ(bom_none, detect("\xef\xbb"));
+    ASSERT_EQ(bom_utf8, detect("\xef\xbb\xbf"));
+    ASSERT_EQ(bom_utf16le, detect("\xff\xfe" "a"));
+    ASSERT_EQ(bom_utf16be, detect("\xfe\xff"));
+    ASSERT_EQ(bom_utf32le, detect(std::string("\xff\xfe\0\0", 4)));
+    ASSERT_EQ(bom_utf32be, detect(std::string("\0\0\xfe\xff", 4)));
+}
+TEST(utf8_fix_bom, strip) {
+    std::string result = "x", input = "\xef\xbb\xbf" "abc\xff";
+    ASSERT_EQ(bom_utf8, fix_utf8_bom(result, ubegin(input), uend(input)));
+    ASSERT_EQ("xabc" + utf8b_encode("\xff"), result);
+    result.clear();
+    input = "abc\xef\xbb\xbf";
+    ASSERT_EQ(bom_none, fix_utf8_bom(result, ubegin(input), uend(input)));
+    ASSERT_EQ(input, result);
+    result.clear();
+    input = std::string("\xff\xfe" "a\0b\0", 6);
+    ASSERT_EQ(bom_utf16le, fix_utf8_bom(result, ubegin(input), uend(input)));
+    ASSERT_EQ("", result);
+}
+
+///////////////////////////////////////////////////////////////////////
+
+TEST(utf8_fix_checked, blocks) {
+    // sequences crossing block boundaries at all positions
+    std::string input;
+    for (int n = 0; input.size() < 3 * 4096; n++)
+        input += n % 11 ? utf8_encode(0x10000 + n) : "\xf0\x90";
+    for (int shift = 0; shift < 4; shift++) {
+        std::string s = input.substr(shift);
+        std::string result, expected;
+        size_t consumed = 0;
+        fix_utf8_limits limits = {size_t(-1), 1.0};
+        ASSERT_EQ(fix_utf8_ok, fix_utf8_checked(result, ubegin(s), uend(s),
+                                                limits, &consumed));
+        fix_utf8(expected, ubegin(s), uend(s));
+        ASSERT_EQ(expected, result);
+        ASSERT_EQ(s.size(), consumed);
+    }
+}
+namespace {
+// Inputs with sequences, complete or not, ending right before or
+// crossing the offset boundary, followed by stray continuation bytes.
+// The rest is made of fill, the input is at least size bytes long.
+std::vector<std::string> straddling(size_t boundary,
+                                    const std::string &fill = "a",
+                                    size_t size = 0)
+{
+    static const char *seqs[] = {
+        "\xf0\x9f\x98\x80", "\xe2\x82\xac", "\xc3\xa9", "\xf0\x9f\x98",
+        "\xe2\x82", "\xf0\x9f", "\xc3", "\xe0\x80", "\xff", "a" };
+    std::vector<std::string> res;
+    for (const char *seq: seqs) {
+        for (size_t tail = 0; tail < 4; tail++) {
+            for (size_t shift = 0; shift < 5; shift++) {
+                std::string s;
+                while (s.size() + fill.size() <= boundary - shift)
+                    s += fill;
+                s.append(boundary - shift - s.size(), 'a');
+                s += seq;
+                s.append(tail, '\x80');
+                s.append(100, 'a');
+                while (s.size() < size)
+                    s += fill;
+                res.push_back(s);
+            }
+        }
+    }
+    return res;
+}
+} // namespace {
+
+TEST(utf8_fix_checked, straddling) {
+    for (const std::string &s: straddling(4096)) {
+        std::string result, expected;
+        size_t consumed = 0;
+        fix_utf8_limits limits = {size_t(-1), 1.0};
+        ASSERT_EQ(fix_utf8_ok, fix_utf8_checked(result, ubegin(s), uend(s),
+                                                limits, &consumed));
+        fix_utf8(expected, ubegin(s), uend(s));
+        ASSERT_EQ(expected, result);
+        ASSERT_EQ(s.size(), consumed);
+        // invalid bytes are counted as in a single pass
+        size_t invalid = sniff_utf8(ubegin(s), uend(s), s.size()).invalid;
+        fix_utf8_limits exact = {invalid, 1.0};
+        result.clear();
+        ASSERT_EQ(fix_utf8_ok, fix_utf8_checked(result, ubegin(s), uend(s),
+                                                exact, &consumed));
+        if (invalid) {
+            fix_utf8_limits below = {invalid - 1, 1.0};
+            result.clear();
+            ASSERT_EQ(fix_utf8_binary,
+                      fix_utf8_checked(result, ubegin(s), uend(s),
+                                       below, &consumed));
+        }
+    }
+}
+TEST(utf8_fix_checked, binary) {
+    std::string text(10000, 'a'), binary;
+    for (int n = 0; n < 10000; n++)
+        binary.push_back(n * 131 % 256);
+    std::string result;
+    size_t consumed = 0;
+    fix_utf8_limits ratio = {size_t(-1), 0.01};
+    ASSERT_EQ(fix_utf8_ok, fix_utf8_checked(result, ubegin(text), uend(text),
+                                            ratio, &consumed));
+    ASSERT_EQ(text, result);
+    result.clear();
+    ASSERT_EQ(fix_utf8_binary,
+              fix_utf8_checked(result, ubegin(binary), uend(binary),
+                               ratio, &consumed));
+    ASSERT_GE(4096u, consumed);
+    std::string expected;
+    fix_utf8(expected, ubegin(binary), ubegin(binary) + consumed);
+    ASSERT_EQ(expected, result);
+    // absolute limit, exceeded in the 3rd block
+    std::string mixed = text + "\xff\xff\xff";
+    fix_utf8_limits bytes = {2, 1.0};
+    result.clear();
+    ASSERT_EQ(fix_utf8_binary,
+              fix_utf8_checked(result, ubegin(mixed), uend(mixed),
+                               bytes, &consumed));
+    ASSERT_EQ(mixed.size(), consumed);
+}
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+utf8_sniff sniff(const std::string &input)
+{
+    return sniff_utf8(ubegin(input), uend(input));
+}
+} // namespace {
+
+TEST(utf8_sniff, counts) {
+    std::string input = std::string("ab\0c\0", 5) + utf8_encode(0x20ac) +
+        "\xe9\x80" + utf8_encode(0x10348) +
+        std::string("a long ASCII run with\0NULs\0in it", 32);
+    utf8_sniff res = sniff(input);
+    ASSERT_EQ(input.size(), res.bytes);
+    ASSERT_EQ(37u, res.ascii);
+    ASSERT_EQ(2u, res.multibyte);
+    ASSERT_EQ(2u, res.invalid);
+    ASSERT_EQ(1u, res.invalid_hist[0x8 & 7]);
+    ASSERT_EQ(1u, res.invalid_hist[0xe & 7]);
+    ASSERT_EQ(3u, res.nul_even);
+    ASSERT_EQ(1u, res.nul_odd);
+    ASSERT_EQ(0u, sniff("").bytes);
+    ASSERT_EQ(4096u, sniff(std::string(10000, 'a')).bytes);
+    // max_bytes cut after a complete sequence followed by a stray byte
+    std::string cut = std::string(10, 'a') + utf8_encode(0x1f600) + "\x80";
+    res = sniff_utf8(ubegin(cut), uend(cut), 14);
+    ASSERT_EQ(14u, res.bytes);
+    ASSERT_EQ(1u, res.multibyte);
+    ASSERT_EQ(0u, res.invalid);
+}
+TEST(utf8_sniff, tiny_max_bytes) {
+    // the sample ends where a single pass ends a step: counts of the
+    // sample and of the rest add up to counts of the whole
+    const char *inputs[] = {
+        "\xf0\x90\x80\xe1\x80\x80", "\x80\x80\x80\x80\x80",
+        "\xe1\x80\xc3\xa9\x80", "a\xf0\x9f\x98\x80\x80", "\xc3\xe0\x80\x80",
+        "\xed\xa0\x80\x80" };
+    for (const char *input: inputs) {
+        std::string s = input;
+        utf8_sniff whole = sniff(s);
+        for (size_t max_bytes = 1; max_bytes < 4; max_bytes++) {
+            utf8_sniff head = sniff_utf8(ubegin(s), uend(s), max_bytes);
+            ASSERT_LT(0u, head.bytes);
+            utf8_sniff tail = sniff(s.substr(head.bytes));
+            ASSERT_EQ(whole.ascii, head.ascii + tail.ascii);
+            ASSERT_EQ(whole.multibyte, head.multibyte + tail.multibyte);
+            ASSERT_EQ(whole.invalid, head.invalid + tail.invalid);
+        }
+    }
+}
+TEST(utf8_sniff, confidence) {
+    utf8_sniff utf8 = sniff("na" + utf8_encode(0xef) + "ve caf" +
+                            utf8_encode(0xe9));
+    ASSERT_EQ(1.0, utf8.utf8);
+    ASSERT_EQ(0.0, utf8.cp1252);
+    ASSERT_EQ(0.0, utf8.utf16);
+    utf8_sniff cp1252 = sniff("na\xefve caf\xe9 \x93quoted\x94");
+    ASSERT_EQ(0.0, cp1252.utf8);
+    ASSERT_EQ(1.0, cp1252.cp1252);
+    utf8_sniff utf16 = sniff(std::string("h\0e\0l\0l\0o\0", 10));
+    ASSERT_EQ(1.0, utf16.utf16);
+    ASSERT_GT(utf16.utf16, utf16.utf8);
+    // continuation bytes of valid sequences aren't undefined cp1252 bytes
+    utf8_sniff cyrillic = sniff("caf\xe9 " + utf8_encode(0x441));
+    ASSERT_DOUBLE_EQ(1.0 / 3, cyrillic.cp1252);
+    utf8_sniff ascii = sniff("plain");
+    ASSERT_EQ(1.0, ascii.utf8);
+    ASSERT_EQ(1.0, ascii.cp1252);
+}
+
+///////////////////////////////////////////////////////////////////////
+
+namespace {
+// the output of adaptive kernels against the plain engine
+void check_adaptive(const std::string &input)
+{
+    std::string res;
+    fix_utf8(res, ubegin(input), uend(input));
+    std::vector<unsigned char> buf(input.size() * 3);
+    size_t size = fix_utf8(&buf[0], ubegin(input), uend(input));
+    ASSERT_EQ(std::string(buf.begin(), buf.begin() + size), res);
+}
+} // namespace {
+
+TEST(utf8_fix_adaptive, kernels) {
+    std::mt19937 rnd;
+    std::string ascii, text, binary;
+    for (size_t k = 0; k < 300000; k++) {
+        ascii += char(rnd() % 128);
+        text += utf8_encode(0x80 + rnd() % 0x780);
+        if (k % 1000 == 0)
+            text += "\xff";
+        binary += char(0x80 + rnd() % 128);
+    }
+    fix_utf8_kernel_counters before = fix_utf8_kernels();
+    check_adaptive(ascii);
+    check_adaptive(text);
+    check_adaptive(binary);
+    check_adaptive(ascii + text + binary);
+    fix_utf8_kernel_counters after = fix_utf8_kernels();
+    ASSERT_GT(after.ascii_run, before.ascii_run);
+    ASSERT_GT(after.validate_copy, before.validate_copy);
+    ASSERT_GT(after.dense_error, before.dense_error);
+}
+TEST(utf8_fix_adaptive, straddling) {
+    // block boundaries (64KB) and validate-copy chunk boundaries (4KB),
+    // with fill picking each of the kernels
+    struct {
+        std::string fill;
+        uint64_t fix_utf8_kernel_counters::*kernel;
+    } cases[] = {
+        { "a", &fix_utf8_kernel_counters::ascii_run },
+        { utf8_encode(0xe9), &fix_utf8_kernel_counters::validate_copy },
+        { "\xff", &fix_utf8_kernel_counters::dense_error },
+    };
+    for (const auto &c: cases) {
+        fix_utf8_kernel_counters before = fix_utf8_kernels();
+        for (size_t boundary: {size_t(4096), size_t(64 * 1024)}) {
+            for (const std::string &s: straddling(boundary, c.fill, 70000))
+                check_adaptive(s);
+        }
+        fix_utf8_kernel_counters after = fix_utf8_kernels();
+        ASSERT_GT(after.*c.kernel, before.*c.kernel);
+    }
+}
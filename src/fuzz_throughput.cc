@@ -0,0 +1,345 @@
+// Search for inputs that are slow to fix (cycles/byte), per kernel.
+//
+// An input is a pattern (up to 4KB) tiled to 64KB, so the per-block kernel
+// selection in fix_utf8 (std::string) sees it as a large input. The
+// loop mutates patterns picked from a corpus; a pattern joins the corpus
+// if it covers something new (pairs of adjacent byte classes as the
+// engine sees them, the kernel picked) or is slower than the corpus
+// average. The slowest pattern per kernel is written to the output
+// directory, run them with benchmark --adversarial DIR.
+//
+// usage: fuzz_throughput [--out DIR] [--seconds S] [--seed N]
+
+#include "fix_utf8.h"
+#include "ticks.h"
+
+#include <sys/stat.h>
+#include <time.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <bitset>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef std::mt19937 Rnd;
+
+const size_t input_size = 64 * 1024;
+const size_t max_pattern = 4096;    // long enough to defeat prediction
+const size_t max_corpus = 512;
+
+double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Byte classes following the engine's switch
+int byte_class(unsigned char c)
+{
+    switch (c) {
+        case 0x00 ... 0x7f: return 0;
+        case 0x80 ... 0xbf: return 1;
+        case 0xc0 ... 0xc1: return 2;
+        case 0xc2 ... 0xdf: return 3;
+        case 0xe0:          return 4;
+        case 0xed:          return 6;
+        case 0xe1 ... 0xec:
+        case 0xee ... 0xef: return 5;
+        case 0xf0:          return 7;
+        case 0xf1 ... 0xf3: return 8;
+        case 0xf4:          return 9;
+        default:            return 10;
+    }
+}
+
+const int classes = 11;
+const int kernels = 3;
+typedef std::bitset<classes * classes + kernels> Features;
+
+// Buckets the slowest input is kept for
+enum { bucket_buffer, bucket_ascii_run, bucket_validate_copy,
+       bucket_dense_error, buckets };
+const char *bucket_names[] = {
+    "buffer", "string-ascii_run", "string-validate_copy",
+    "string-dense_error" };
+
+struct Entry
+{
+    std::string pattern;
+    double cost;        // max cycles/byte over the targets
+    Features features;
+};
+
+std::string tile(const std::string &pattern)
+{
+    std::string res;
+    res.reserve(input_size);
+    while (res.size() < input_size)
+        res.append(pattern, 0, std::min(pattern.size(),
+                                        input_size - res.size()));
+    return res;
+}
+
+// Fastest of a few runs, cycles/byte
+template <typename F>
+double cost(const std::string &input, F f)
+{
+    uint64_t best = ~0ull;
+    for (int k = 0; k < 3; k++) {
+        uint64_t start = ticks();
+        f();
+        best = std::min(best, ticks() - start);
+    }
+    return (double)best / input.size();
+}
+
+struct Evaluation
+{
+    double cpb[2];      // buffer, string
+    int kernel;         // picked for the string
+    Features features;
+};
+
+Evaluation evaluate(const std::string &pattern, std::vector<unsigned char> &buf)
+{
+    Evaluation res;
+    std::string input = tile(pattern);
+    const unsigned char *i =
+        reinterpret_cast<const unsigned char *>(input.c_str());
+    const unsigned char *end = i + input.size();
+
+    res.cpb[0] = cost(input, [&]() { fix_utf8(&buf[0], i, end); });
+
+    fix_utf8_kernel_counters before = fix_utf8_kernels();
+    res.cpb[1] = cost(input, [&]() {
+        std::string out;
+        fix_utf8(out, i, end);
+    });
+    fix_utf8_kernel_counters after = fix_utf8_kernels();
+    res.kernel =
+        after.ascii_run != before.ascii_run ? 0 :
+        after.validate_copy != before.validate_copy ? 1 : 2;
+
+    for (size_t k = 0; k + 1 < input.size() && k < 2 * pattern.size(); k++)
+        res.features.set(byte_class(input[k]) * classes +
+                         byte_class(input[k + 1]));
+    res.features.set(classes * classes + res.kernel);
+    return res;
+}
+
+// Bytes the engine branches on
+const unsigned char interesting[] = {
+    'a', '\n', 0x7f, 0x80, 0x8f, 0x90, 0x9f, 0xa0, 0xbf, 0xc0, 0xc1, 0xc2,
+    0xdf, 0xe0, 0xe1, 0xec, 0xed, 0xee, 0xef, 0xf0, 0xf1, 0xf3, 0xf4,
+    0xf5, 0xff };
+
+std::string mutate(const std::string &parent, const std::vector<Entry> &corpus,
+                   Rnd &rnd)
+{
+    std::string res = parent;
+    auto pick = [&](size_t n) {
+        return std::uniform_int_distribution<size_t>(0, n - 1)(rnd);
+    };
+    for (int n = 1 + pick(4); n; n--) {
+        size_t pos = pick(res.size() + 1);
+        unsigned char c = interesting[pick(sizeof interesting)];
+        switch (pick(9)) {
+            case 0:
+                if (pos < res.size())
+                    res[pos] ^= 1 << pick(8);
+                break;
+            case 1:
+                if (pos < res.size())
+                    res[pos] = c;
+                break;
+            case 2:
+                res.insert(pos, 1, c);
+                break;
+            case 3:
+                if (pos < res.size() && res.size() > 1)
+                    res.erase(pos, 1);
+                break;
+            case 4: {
+                // a valid sequence
+                static const char *seqs[] = {
+                    "a", "\xc3\xa9", "\xe4\xb8\x80", "\xed\x9f\xbf",
+                    "\xf0\x9f\x98\x80", "\xf4\x8f\xbf\xbf" };
+                res.insert(pos, seqs[pick(6)]);
+                break;
+            }
+            case 5: {
+                // a lead byte with too few continuation bytes
+                std::string seq(1, 0xc2 + pick(0x33));
+                seq.append(pick(3), '\x80');
+                res.insert(pos, seq);
+                break;
+            }
+            case 6: {
+                size_t from = pick(res.size());
+                size_t len = 1 + pick(res.size() - from);
+                res.insert(pos, res.substr(from, len));
+                break;
+            }
+            case 7: {
+                const std::string &other = corpus[pick(corpus.size())].pattern;
+                size_t from = pick(other.size());
+                res.insert(pos, other.substr(from, 1 + pick(16)));
+                break;
+            }
+            case 8:
+                // scramble a chunk with interesting bytes
+                for (size_t k = pos, len = 1 + pick(64);
+                     k < res.size() && len; k++, len--)
+                    res[k] = interesting[pick(sizeof interesting)];
+                break;
+        }
+    }
+    if (res.size() > max_pattern)
+        res.resize(max_pattern);
+    if (res.empty())
+        res = "a";
+    return res;
+}
+
+void usage()
+{
+    std::cerr <<
+        "usage: fuzz_throughput [options]\n"
+        "  --out DIR       where to write the slowest inputs (adversarial)\n"
+        "  --seconds S     time budget (60)\n"
+        "  --seed N        (1)\n";
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    std::string out = "adversarial";
+    double seconds = 60.0;
+    unsigned seed = 1;
+    for (int k = 1; k < argc; k++) {
+        if (k + 1 == argc)
+            usage();
+        std::string arg = argv[k];
+        const char *val = argv[++k];
+        if (arg == "--out")
+            out = val;
+        else if (arg == "--seconds")
+            seconds = atof(val);
+        else if (arg == "--seed")
+            seed = atoi(val);
+        else
+            usage();
+    }
+    if (mkdir(out.c_str(), 0777) != 0 && errno != EEXIST) {
+        std::cerr << out << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    Rnd rnd(seed);
+    std::vector<unsigned char> buf(input_size * 3);
+    std::vector<Entry> corpus;
+    Features covered;
+    Entry best[buckets];
+    for (auto &entry: best) {
+        entry.cost = 0.0;
+    }
+
+    auto consider = [&](const std::string &pattern) {
+        Evaluation ev = evaluate(pattern, buf);
+        Entry entry = { pattern, std::max(ev.cpb[0], ev.cpb[1]),
+                        ev.features };
+
+        double avg = 0.0;
+        for (auto &e: corpus) {
+            avg += e.cost / corpus.size();
+        }
+        bool new_coverage = (ev.features & ~covered).any();
+        if (new_coverage || corpus.empty() || entry.cost > avg) {
+            covered |= ev.features;
+            corpus.push_back(entry);
+            if (corpus.size() > max_corpus) {
+                // drop the cheapest
+                auto cheapest = std::min_element(corpus.begin(),
+                    corpus.end(), [](const Entry &a, const Entry &b) {
+                        return a.cost < b.cost;
+                    });
+                corpus.erase(cheapest);
+            }
+        }
+
+        double costs[buckets] = {};
+        costs[bucket_buffer] = ev.cpb[0];
+        costs[bucket_ascii_run + ev.kernel] = ev.cpb[1];
+        for (int b = 0; b < buckets; b++) {
+            if (costs[b] > best[b].cost) {
+                best[b] = Entry { pattern, costs[b], ev.features };
+                std::string path = out + "/" + bucket_names[b] + ".bin";
+                std::ofstream file(path, std::ios::binary);
+                file << pattern;
+                file.close();
+                if (!file) {
+                    std::cerr << path << ": " << strerror(errno)
+                        << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    };
+
+    for (const char *seed_pattern: {
+            "a", "\xc3\xa9", "\xe4\xb8\x80", "\xf0\x9f\x98\x80", "\xff",
+            "\xc3", "\xe0\x80", "a\xff", "abcdefghijklmnop\xc3\xa9" })
+        consider(seed_pattern);
+    // random bytes, random interesting bytes
+    std::string random_bytes, random_interesting;
+    for (size_t k = 0; k < max_pattern; k++) {
+        random_bytes += (char)rnd();
+        random_interesting += interesting[rnd() % sizeof interesting];
+    }
+    consider(random_bytes);
+    consider(random_interesting);
+
+    size_t iterations = 0;
+    double start = now(), report = start;
+    while (now() - start < seconds) {
+        // tournament: the costliest of a few, sometimes any
+        size_t parent = std::uniform_int_distribution<size_t>(
+            0, corpus.size() - 1)(rnd);
+        for (int k = 0; k < 3; k++) {
+            size_t other = std::uniform_int_distribution<size_t>(
+                0, corpus.size() - 1)(rnd);
+            if (corpus[other].cost > corpus[parent].cost)
+                parent = other;
+        }
+        consider(mutate(corpus[parent].pattern, corpus, rnd));
+        iterations++;
+        if (now() - report > 10.0) {
+            report = now();
+            std::cerr << iterations << " iterations, corpus "
+                << corpus.size() << ", coverage " << covered.count()
+                << std::endl;
+        }
+    }
+
+    std::cout << "# slowest inputs, cycles/byte (" << iterations
+        << " iterations)" << std::endl;
+    for (int b = 0; b < buckets; b++) {
+        std::cout << bucket_names[b] << "\t ";
+        if (best[b].cost)
+            std::cout << std::fixed << std::setprecision(2) << best[b].cost
+                << "\t " << out << "/" << bucket_names[b] << ".bin ("
+                << best[b].pattern.size() << " bytes)";
+        else
+            std::cout << "not reached";
+        std::cout << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+# Generate fix_utf8_tables.h (Unicode tables used by fix_utf8.cc) from
+# the unicodedata module:
+#
+#   python3 gen_tables.py > fix_utf8_tables.h
+
+import sys
+import unicodedata
+
+
+def width(cp):
+    """Terminal column width, wcwidth-style."""
+    if cp < 0x20 or 0x7f <= cp < 0xa0:
+        return 0
+    if 0xd800 <= cp <= 0xdfff:
+        return 1  # UTF-8B escapes
+    c = chr(cp)
+    cat = unicodedata.category(c)
+    if cp == 0xad:
+        return 1  # soft hyphen
+    if cat in ('Mn', 'Me', 'Cf') or 0x1160 <= cp <= 0x11ff or cp == 0x200b:
+        return 0
+    if unicodedata.east_asian_width(c) in ('W', 'F'):
+        return 2
+    return 1
+
+
+def lower(cp):
+    """Simple lowercase mapping (the full one may produce several)."""
+    if 0xd800 <= cp <= 0xdfff:
+        return cp
+    if cp == 0x130:
+        return 0x69  # LATIN CAPITAL LETTER I WITH DOT ABOVE
+    res = chr(cp).lower()
+    assert len(res) == 1, hex(cp)
+    return ord(res)
+
+
+def two_level(values, block_bits, pack):
+    """Split values into blocks of 2**block_bits, dedupe blocks."""
+    size = 1 << block_bits
+    index, blocks, ids = [], [], {}
+    for start in range(0, len(values), size):
+        block = pack(values[start:start + size])
+        if block not in ids:
+            ids[block] = len(blocks)
+            blocks.append(block)
+        index.append(ids[block])
+    return index, blocks
+
+
+def pack2(values):
+    """4 2-bit values per byte, the first one in the low bits."""
+    return tuple(sum(v << (2 * k) for k, v in enumerate(values[i:i + 4]))
+                 for i in range(0, len(values), 4))
+
+
+def emit_array(out, decl, values, per_line=16):
+    out.write('%s = {\n' % decl)
+    for i in range(0, len(values), per_line):
+        out.write('    ' + ', '.join('%d' % v for v in
+                                     values[i:i + per_line]) + ',\n')
+    out.write('};\n')
+
+
+def main(out):
+    out.write('// Generated by gen_tables.py (Unicode %s), do not edit.\n'
+              % unicodedata.unidata_version)
+    out.write('#pragma once\n#include <cstdint>\n\nnamespace {\n\n')
+
+    index, blocks = two_level([width(cp) for cp in range(0x110000)], 8,
+                              pack2)
+    assert len(blocks) <= 256
+    out.write('// Display width, 2 bits per code point:\n')
+    out.write('// width_blocks[width_index[cp >> 8]][(cp & 0xff) >> 2]\n')
+    emit_array(out, 'const unsigned char width_index[%d]' % len(index),
+               index)
+    out.write('const unsigned char width_blocks[%d][64] = {\n'
+              % len(blocks))
+    for block in blocks:
+        out.write('    {\n')
+        for i in range(0, 64, 16):
+            out.write('        ' + ', '.join('%d' % v for v in
+                                             block[i:i + 16]) + ',\n')
+        out.write('    },\n')
+    out.write('};\n')
+
+    deltas = []
+    for cp in range(0x10000):
+        res = lower(cp)
+        assert res < 0x10000
+        deltas.append((res - cp) & 0xffff)
+    index, blocks = two_level(deltas, 8, tuple)
+    out.write('\n// Simple lowercase mapping of the BMP, as a delta modulo 2^16:\n')
+    out.write('// lower_blocks[lower_index[cp >> 8]][cp & 0xff]\n')
+    emit_array(out, 'const unsigned char lower_index[%d]' % len(index),
+               index)
+    out.write('const uint16_t lower_blocks[%d][256] = {\n' % len(blocks))
+    for block in blocks:
+        out.write('    {\n')
+        for i in range(0, 256, 8):
+            out.write('        ' + ', '.join('0x%04x' % v for v in
+                                             block[i:i + 8]) + ',\n')
+        out.write('    },\n')
+    out.write('};\n')
+
+    out.write('\n} // namespace {\n')
+
+
+if __name__ == '__main__':
+    main(sys.stdout)
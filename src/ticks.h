@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+#include <time.h>
+#if __x86_64__ || __i386__
+#include <x86intrin.h>
+#endif
+
+#ifndef CLOCK_MONOTONIC_RAW
+#define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
+#endif
+
+// Serialized TSC read for timing single short calls (a monotonic clock
+// in ns where there's no TSC)
+inline uint64_t ticks()
+{
+#if __x86_64__ || __i386__
+    _mm_lfence();
+    uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}